@@ -10,22 +10,33 @@
                 If element a is inserted before element b then a will have a smaller index.
                 All indexes into buffer are translated to be between [0, size of buffer).
                 By default the oldest element is removed upon removal.
+                Storage is raw memory: only the size_ live elements are constructed (with
+                placement new), growth move constructs them into the new storage, and T
+                never needs a default constructor.
                 
  *********************************************************************************************/
 
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #ifndef CM_CIRCULAR_BUFFER
 #define CM_CIRCULAR_BUFFER
 
 template <class T>
 class CircularBuffer{
-  T* buff_;
+  T* buff_;         /* Raw storage for capacity_ elements; only the size_ live ones are constructed */
   size_t start_;    /* First element in the circular buffer */
   size_t size_;     /* size_ is number of elements [0, size_] */
   size_t capacity_; /* capacity_ is a power of 2 */
 
+  static_assert(alignof(T) <= alignof(std::max_align_t), "CircularBuffer: over-aligned T");
 
   /* Next Power of 2 >= n assume size_t is 64-bit */
   inline size_t next_pow2(size_t n){
+    if (n == 0) return 0;
     --n;
     n |= n >> 1;
     n |= n >> 2;
@@ -37,45 +48,66 @@ class CircularBuffer{
     return n;
   }
 
+  static T* allocate(size_t n){
+    return (n == 0) ? NULL : static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  /* Destroys the live elements and frees the storage */
+  void release(){
+    for (size_t i = 0; i < size_; ++i){
+      (*this)[i].~T();
+    }
+    if (buff_ != NULL){
+      ::operator delete(buff_);
+    }
+  }
+
   /* size must be a power of 2 /\ size >= size_ */
   inline void resize_aux(const size_t size){
-    T* tmp = new T[size]();
+    T* tmp = allocate(size);
     for (size_t i = 0; i < size_; ++i){ /* Realign from [0,size()) */
-      tmp[i] = (*this)[i];
+      T& item = (*this)[i];
+      new (&tmp[i]) T(std::move_if_noexcept(item));
+      item.~T();
     }
-    start_ = 0;
-    capacity_ = size;
     if (buff_ != NULL){
-      delete[] buff_;
+      ::operator delete(buff_);
     }
+    start_ = 0;
+    capacity_ = size;
     buff_ = tmp;
   }
+
+  /* Slot for one more element at the end */
+  T* grow_back(){
+    if (size_ == capacity_){
+      resize_aux((1 < 2*capacity_) ? 2*capacity_ : 1);
+    }
+    return &(*this)[size_];
+  }
   
  public:
-  CircularBuffer(size_t size = 0) : buff_(NULL), start_(0), size_(0), capacity_(size) {
-    if (capacity_ == 0) return;
+  CircularBuffer(size_t size = 0) : buff_(NULL), start_(0), size_(0), capacity_(0) {
+    if (size == 0) return;
     resize(size);
   }
 
   /* Copy Constructor */
-  CircularBuffer(const CircularBuffer& other) : buff_(NULL), start_(0), size_(0), capacity_(other.capacity_) {
-    if (capacity_ == 0) return;
-    buff_ = new T[capacity_]();
+  CircularBuffer(const CircularBuffer& other) : buff_(allocate(other.capacity_)), start_(0), size_(0), capacity_(other.capacity_) {
     for (; size_ < other.size_; ++size_){
-      buff_[size_] = other[size_];
+      new (&buff_[size_]) T(other[size_]);
     }
   }
 
   /* Move Constructor */
   CircularBuffer(CircularBuffer&& other) noexcept : buff_(other.buff_), start_(other.start_), size_(other.size_), capacity_(other.capacity_) {
     other.buff_ = NULL;
+    other.start_ = other.size_ = other.capacity_ = 0;
   }
 
   /* Destructor */
   ~CircularBuffer() noexcept {
-    if (buff_ != NULL){
-      delete[] buff_;
-    }
+    release();
   }
 
   /* Copy Assignment Operator */
@@ -87,17 +119,18 @@ class CircularBuffer{
 
   /* Move Assignment Operator */
   CircularBuffer& operator = (CircularBuffer&& other) noexcept {
-    if (buff_ != NULL){
-      delete[] buff_;
-    }
+    if (this == &other) return *this;
+    release();
     buff_ = other.buff_;
     start_ = other.start_;
     size_ = other.size_;
     capacity_ = other.capacity_;
     other.buff_ = NULL;
+    other.start_ = other.size_ = other.capacity_ = 0;
     return *this;
   }
 
+  /* size must be >= size() */
   void resize(size_t size){
     resize_aux(next_pow2(size));
   }
@@ -105,19 +138,27 @@ class CircularBuffer{
   /* Most recent goes at the end of the buffer */
   void insert(const T& val){
     if (size_ == capacity_){
-      resize_aux((1 < 2*capacity_) ? 2*capacity_ : 1);
+      T copy(val); /* val may live in the storage about to be moved */
+      insert(std::move(copy));
+      return;
     }
-    (*this)[size_++] = val;
+    new (grow_back()) T(val);
+    ++size_;
+  }
+
+  void insert(T&& val){
+    new (grow_back()) T(std::move(val));
+    ++size_;
   }
 
   /* preserves ordering of non-removed objects */
   void remove(size_t index = 0){
     if (index >= size_) return;
 
-    T val = (*this)[index];
     for (; index != 0; --index){
-      (*this)[index] = (*this)[index-1];
+      (*this)[index] = std::move((*this)[index-1]);
     }
+    (*this)[0].~T();
     ++start_;
     start_ &= (capacity_ - 1);
     --size_;
@@ -130,16 +171,23 @@ class CircularBuffer{
     remove(index); /* does nothing if val is not found in buff_ */
   }
   
-  /* Removes all items smaller than or equal to val and returns them as a vector*/
+  /* Removes all items smaller than or equal to val and returns them as a vector (one pass) */
   std::vector<T> remove_smaller(const T& val){
-    size_t index(0);
     std::vector<T> rm_vec;
-    for(; index < size_ ; index++){
-      if(val <= (*this)[index]){ 
-        rm_vec.push_back((*this)[index]);
-        remove(index);       
+    size_t kept = 0;
+    for (size_t index = 0; index < size_; ++index){
+      T& item = (*this)[index];
+      if (item <= val){
+        rm_vec.push_back(std::move(item));
+      } else {
+        if (kept != index) (*this)[kept] = std::move(item);
+        ++kept;
       }
     }
+    for (size_t index = kept; index < size_; ++index){
+      (*this)[index].~T();
+    }
+    size_ = kept;
     return rm_vec;
   }
 
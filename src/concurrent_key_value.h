@@ -0,0 +1,202 @@
+/***********************************************************************************
+    Description: A thread safe Key-Value storage with the same interface as
+                 KeyValueStore. The keyspace is split by hash into SHARDS independent
+                 tables, each guarded by its own reader/writer lock, so operations on
+                 keys in different shards never contend and readers of one shard
+                 only contend with its writers.
+                 Keys are hashed once per operation: the same hash picks the shard and is
+                 handed to the shard's table as a HashedKey (hashed_key.h), which callers
+                 may also pass in directly.
+ ***********************************************************************************/
+#include "hash_table.h"
+#include "hashed_key.h"
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+
+#ifndef CM_CONCURRENT_KEY_VALUE_STORE
+#define CM_CONCURRENT_KEY_VALUE_STORE
+
+template <class K, class V, class Table = HashTable<K, V>, size_t SHARDS = 64>
+class ConcurrentKeyValueStore{
+  typedef std::shared_timed_mutex lock_t;
+
+  struct shard_t{
+    lock_t lock;
+    Table table;
+  };
+
+ public:
+  /*********************************************************
+     Constructor / Destructor / etc.
+   *********************************************************/
+  ConcurrentKeyValueStore() : shards_(new shard_t[SHARDS]) {}
+
+  ~ConcurrentKeyValueStore(){
+    delete[] shards_;
+  }
+
+  /* Only valid while no other thread is using either store */
+  ConcurrentKeyValueStore& operator = (ConcurrentKeyValueStore&& other){
+    for (size_t i = 0; i < SHARDS; ++i){
+      shards_[i].table = std::move(other.shards_[i].table);
+    }
+    return *this;
+  }
+
+  ConcurrentKeyValueStore(const ConcurrentKeyValueStore&) = delete;
+  ConcurrentKeyValueStore& operator = (const ConcurrentKeyValueStore&) = delete;
+
+  /*********************************************************
+     Key Value Semantics Operations
+   *********************************************************/
+
+  /* KV find_t type is just the underlying hashtable find_t */
+  typedef typename Table::find_t find_t;
+  typedef typename Table::value_t value_t;
+
+  find_t find(const K& key){
+    return find(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  find_t find(const HashedKey<Q>& key){
+    shard_t& shard = shard_of(key.hash());
+    std::shared_lock<lock_t> lock(shard.lock);
+    return shard.table.find(key);
+  }
+
+  V get(const K& key) {
+    return get(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  V get(const HashedKey<Q>& key) {
+    shard_t& shard = shard_of(key.hash());
+    std::shared_lock<lock_t> lock(shard.lock);
+    return static_cast<const Table&>(shard.table)[key]; /* A miss reads as V() */
+  }
+
+  void put(const K& key, const V& value){
+    put(HashedKey<K>(key), value);
+  }
+
+  void put(const HashedKey<K>& key, const V& value){
+    shard_t& shard = shard_of(key.hash());
+    std::unique_lock<lock_t> lock(shard.lock);
+    shard.table.insert(key, value);
+  }
+
+  void remove(const K& key){
+    remove(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  void remove(const HashedKey<Q>& key){
+    shard_t& shard = shard_of(key.hash());
+    std::unique_lock<lock_t> lock(shard.lock);
+    shard.table.remove(key);
+  }
+
+  /* Applies fn(const V&) in place under the shard's shared lock (no copy of the value);
+     returns false if key is absent */
+  template <class F>
+  bool read(const K& key, F fn){
+    return read(HashedKey<K>(key), fn);
+  }
+
+  template <class Q, class F>
+  bool read(const HashedKey<Q>& key, F fn){
+    shard_t& shard = shard_of(key.hash());
+    std::shared_lock<lock_t> lock(shard.lock);
+    return shard.table.modify(key, [&fn](const V& value){ fn(value); });
+  }
+
+  /* Applies fn(V&) in place under the shard's exclusive lock; returns false if key is absent */
+  template <class F>
+  bool modify(const K& key, F fn){
+    return modify(HashedKey<K>(key), fn);
+  }
+
+  template <class Q, class F>
+  bool modify(const HashedKey<Q>& key, F fn){
+    shard_t& shard = shard_of(key.hash());
+    std::unique_lock<lock_t> lock(shard.lock);
+    return shard.table.modify(key, fn);
+  }
+
+  /* Applies fn(V&) in place under the shard's exclusive lock, inserting V() first if absent */
+  template <class F>
+  void upsert(const K& key, F fn){
+    upsert(HashedKey<K>(key), fn);
+  }
+
+  template <class F>
+  void upsert(const HashedKey<K>& key, F fn){
+    shard_t& shard = shard_of(key.hash());
+    std::unique_lock<lock_t> lock(shard.lock);
+    shard.table.upsert(key, fn);
+  }
+
+  /**********************************************************
+     Iteration walks the shards in order, holding the exclusive
+     lock of the shard it is in (a table's begin() may finish a
+     resize), so it only ever blocks that shard. It is move only
+     and must not be used to touch the store it walks.
+   **********************************************************/
+  class iterator {
+    shard_t* shards_;
+    size_t shard_;
+    std::unique_lock<lock_t> lock_;
+    typename Table::iterator it_;
+  public:
+    iterator() : shards_(NULL), shard_(SHARDS) {}
+    iterator(shard_t* shards, size_t shard) : shards_(shards), shard_(shard) {
+      if (shard_ < SHARDS){
+	lock_ = std::unique_lock<lock_t>(shards_[shard_].lock);
+	it_ = shards_[shard_].table.begin();
+	skip();
+      }
+    }
+    iterator(iterator&&) = default;
+    iterator& operator = (iterator&&) = default;
+    iterator& operator++() {
+      ++it_;
+      skip();
+      return *this;
+    }
+    bool operator ==(const iterator& it) { return (shard_ == it.shard_) && (shard_ == SHARDS || it_ == it.it_); }
+    bool operator !=(const iterator& it) { return !((*this) == it); }
+    const value_t& operator*() const { return *it_; }
+    value_t& operator*() { return *it_; }
+  private:
+    void skip() {
+      while (shard_ < SHARDS && it_ == shards_[shard_].table.end()){
+	lock_ = std::unique_lock<lock_t>();
+	if (++shard_ < SHARDS){
+	  lock_ = std::unique_lock<lock_t>(shards_[shard_].lock);
+	  it_ = shards_[shard_].table.begin();
+	}
+      }
+    }
+  };
+
+  iterator begin() const {
+    return iterator(shards_, 0);
+  }
+
+  iterator end() const {
+    return iterator(shards_, SHARDS);
+  }
+
+ private:
+  shard_t* shards_;
+
+  /* Use the high bits so the shard is independent of the table's own bucket choice */
+  shard_t& shard_of(size_t hash){
+    size_t h = hash * 0x9e3779b97f4a7c15ULL;
+    return shards_[(h >> 40) % SHARDS];
+  }
+};
+
+#endif
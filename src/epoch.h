@@ -0,0 +1,150 @@
+/*********************************************************************************************
+   Description: Epoch based reclamation for lock free readers.
+                Readers wrap every access in an EpochGuard, which announces the global epoch
+                the reader started in. A writer that unlinks an object hands it to retire();
+                the object is deleted once every reader that might still see it has left,
+                i.e. once every announced epoch is newer than the epoch it was retired in.
+                retire() must be serialized by the caller (one writer at a time).
+                Guards do not nest.
+
+ *********************************************************************************************/
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifndef CM_EPOCH
+#define CM_EPOCH
+
+#define EPOCH_MAX_THREADS 256 /* Threads that may hold a guard at the same time */
+
+/* Small dense ids for threads so each can own one announcement slot per EpochManager */
+class EpochThreadId {
+  struct registry_t{
+    std::mutex lock;
+    std::vector<size_t> free;
+    size_t next = 0;
+  };
+
+  static registry_t& registry(){
+    static registry_t r;
+    return r;
+  }
+
+  size_t id_;
+
+  EpochThreadId(){
+    registry_t& r = registry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    if (!r.free.empty()){
+      id_ = r.free.back();
+      r.free.pop_back();
+    } else if (r.next < EPOCH_MAX_THREADS){
+      id_ = r.next++;
+    } else {
+      throw std::runtime_error("EpochThreadId: more than EPOCH_MAX_THREADS threads");
+    }
+  }
+
+ public:
+  ~EpochThreadId(){
+    registry_t& r = registry();
+    std::unique_lock<std::mutex> lock(r.lock);
+    r.free.push_back(id_);
+  }
+
+  static size_t get(){
+    static thread_local EpochThreadId self;
+    return self.id_;
+  }
+};
+
+class EpochManager {
+  struct slot_t{ /* Padded to a cache line so readers don't false share */
+    std::atomic<uint64_t> epoch; /* 0 when the thread is outside of a guard */
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  struct retired_t{
+    uint64_t epoch;
+    void* ptr;
+    void (*deleter)(void*);
+  };
+
+  std::atomic<uint64_t> epoch_;
+  slot_t slots_[EPOCH_MAX_THREADS];
+  std::vector<retired_t> retired_;
+
+  template <class T>
+  static void delete_as(void* ptr){
+    delete static_cast<T*>(ptr);
+  }
+
+ public:
+  EpochManager() : epoch_(1) {
+    for (size_t i = 0; i < EPOCH_MAX_THREADS; ++i){
+      slots_[i].epoch.store(0);
+    }
+  }
+
+  ~EpochManager(){
+    for (size_t i = 0; i < retired_.size(); ++i){
+      retired_[i].deleter(retired_[i].ptr);
+    }
+  }
+
+  EpochManager(const EpochManager&) = delete;
+  EpochManager& operator = (const EpochManager&) = delete;
+
+  void enter(){
+    slots_[EpochThreadId::get()].epoch.store(epoch_.load());
+  }
+
+  void exit(){
+    slots_[EpochThreadId::get()].epoch.store(0, std::memory_order_release);
+  }
+
+  /* ptr must already be unreachable for readers that enter from now on */
+  template <class T>
+  void retire(T* ptr){
+    if (ptr == NULL) return;
+    retired_t r = { epoch_.fetch_add(1), ptr, &delete_as<T> };
+    retired_.push_back(r);
+    if (retired_.size() >= 64){
+      collect();
+    }
+  }
+
+  /* Deletes everything retired before the oldest announced epoch */
+  void collect(){
+    uint64_t oldest = epoch_.load();
+    for (size_t i = 0; i < EPOCH_MAX_THREADS; ++i){
+      uint64_t e = slots_[i].epoch.load();
+      if (e != 0 && e < oldest){
+	oldest = e;
+      }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i){
+      if (retired_[i].epoch < oldest){
+	retired_[i].deleter(retired_[i].ptr);
+      } else {
+	retired_[kept++] = retired_[i];
+      }
+    }
+    retired_.resize(kept);
+  }
+};
+
+/* Scoped reader critical section */
+class EpochGuard {
+  EpochManager& manager_;
+ public:
+  EpochGuard(EpochManager& manager) : manager_(manager) { manager_.enter(); }
+  ~EpochGuard() { manager_.exit(); }
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator = (const EpochGuard&) = delete;
+};
+
+#endif
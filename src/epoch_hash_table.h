@@ -0,0 +1,375 @@
+/******************************************************************************************
+    Description: A read optimized hash_table with the same interface as HashTable where
+                 find and operator[] never take a lock.
+                 Every bucket is a chain of immutable nodes behind an atomic head pointer.
+                 Writers (serialized by an internal mutex) build the replacement chain
+                 prefix off to the side, publish it with a single atomic store and retire
+                 the nodes it replaced through epoch based reclamation (epoch.h).
+                 Readers therefore always see either the old or the new chain, never a
+                 partially updated one. Lookups return copies of values, not references.
+                 Iteration is not synchronized with writers.
+                 Every operation also accepts a HashedKey (hashed_key.h) in place of the key.
+
+ ******************************************************************************************/
+#include "epoch.h"
+#include "hashed_key.h"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+#ifndef CM_EPOCH_HASH_TABLE
+#define CM_EPOCH_HASH_TABLE
+
+template <class K, class V>
+class EpochHashTable {
+ public:
+  /* Type of values for the hash_table */
+  struct value_t{
+    value_t() : hash(0) {}
+    value_t(size_t h, const K& k, const V& v) : hash(h), key(k), value(v) {}
+    size_t hash;
+    K key;
+    V value;
+  };
+
+ private:
+  struct node_t{
+    node_t(const value_t& v, node_t* n) : item(v), next(n) {}
+    const value_t item;
+    node_t* const next;
+  };
+
+  struct table_t{
+    table_t(size_t c) : capacity(c), buckets(new std::atomic<node_t*>[c]) {
+      for (size_t i = 0; i < capacity; ++i){
+	buckets[i].store(NULL, std::memory_order_relaxed);
+      }
+    }
+    ~table_t(){
+      delete[] buckets;
+    }
+    const size_t capacity;
+    std::atomic<node_t*>* buckets;
+  };
+
+  /* Reclaims a table together with every node still reachable from it */
+  struct retired_table_t{
+    retired_table_t(table_t* t) : table(t) {}
+    ~retired_table_t(){
+      free_nodes(table);
+      delete table;
+    }
+    table_t* table;
+  };
+
+ public:
+  /**********************************************************************
+                Iterator and Constant Iterator Types
+  **********************************************************************/
+  class iterator {
+    table_t* table_;
+    size_t index_;
+    node_t* node_;
+  public:
+    iterator() : table_(NULL), index_(0), node_(NULL) {}
+    iterator(table_t* table, size_t index) : table_(table), index_(index), node_(NULL) {
+      if (table_ == NULL){ index_ = 0; return; }
+      if (index_ < table_->capacity){
+	node_ = table_->buckets[index_].load();
+	skip();
+      }
+    }
+    iterator& operator++() {
+      if (node_ == NULL) return *this;
+      node_ = node_->next;
+      skip();
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator tmp(*this); ++(*this); return tmp;
+    }
+    bool operator ==(const iterator& it) { return (table_ == it.table_) && (index_ == it.index_) && (node_ == it.node_); }
+    bool operator !=(const iterator& it) { return !((*this) == it); }
+    const value_t& operator*() const { return node_->item; }
+  private:
+    void skip() {
+      while (node_ == NULL && index_ < table_->capacity){
+	if (++index_ < table_->capacity){
+	  node_ = table_->buckets[index_].load();
+	}
+      }
+    }
+  };
+  typedef iterator const_iterator;
+
+  /* Return Type of the find functionality */
+  struct find_t{
+    find_t() : found(false) {}
+    find_t(const V& v) : found(true), value(v) {}
+    bool found;
+    V value;
+  };
+
+  /************************************************************************
+             Constructors, Destructors, and Assigment Operators
+   ************************************************************************/
+  /* Default Constructor */
+  EpochHashTable() : table_(NULL), size_(0), epochs_(new EpochManager()) {}
+
+  /* Move Constructor (neither table may be in use) */
+  EpochHashTable(EpochHashTable&& other) noexcept : table_(other.table_.load()), size_(other.size_), epochs_(other.epochs_) {
+    other.table_.store(NULL);
+    other.size_ = 0;
+    other.epochs_ = new EpochManager();
+  }
+
+  /* Destructor */
+  ~EpochHashTable() noexcept {
+    delete epochs_; /* frees everything retired so far */
+    table_t* table = table_.load();
+    if (table != NULL){
+      free_nodes(table);
+      delete table;
+    }
+  }
+
+  /* Move Assignment (neither table may be in use) */
+  EpochHashTable& operator = (EpochHashTable&& other) noexcept {
+    EpochHashTable tmp(std::move(other));
+    std::swap(epochs_, tmp.epochs_);
+    table_t* table = table_.load();
+    table_.store(tmp.table_.load());
+    tmp.table_.store(table);
+    std::swap(size_, tmp.size_);
+    return *this;
+  }
+
+  EpochHashTable(const EpochHashTable&) = delete;
+  EpochHashTable& operator = (const EpochHashTable&) = delete;
+
+  /*******************************************************************
+              Insert, Remove, and Find operations
+  ********************************************************************/
+  void insert(const K& key, const V& val){
+    insert(HashedKey<K>(key), val);
+  }
+
+  void insert(const HashedKey<K>& hkey, const V& val){
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    if (size_*2 >= capacity()){
+      resize();
+    }
+    size_t hash = hkey.hash();
+    const K& key = hkey.key();
+    table_t* table = table_.load();
+    std::atomic<node_t*>& head = table->buckets[hash%table->capacity];
+    node_t* target = find_node(head.load(), hash, key);
+    if (target == NULL){
+      head.store(new node_t(value_t(hash, key, val), head.load()));
+      ++size_;
+      return;
+    }
+    replace(head, target, new node_t(value_t(hash, key, val), target->next));
+  }
+
+  void remove(const K& key){
+    remove(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  void remove(const HashedKey<Q>& key){
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    table_t* table = table_.load();
+    if (table == NULL){ return; }
+    size_t hash = key.hash();
+    std::atomic<node_t*>& head = table->buckets[hash%table->capacity];
+    node_t* target = find_node(head.load(), hash, key.key());
+    if (target == NULL){ return; }
+    replace(head, target, target->next);
+    --size_;
+  }
+
+  find_t find(const K& key) const {
+    return find(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  find_t find(const HashedKey<Q>& key) const {
+    EpochGuard guard(*epochs_);
+    const node_t* node = lookup(key);
+    if (node == NULL){ return find_t(); }
+    return find_t(node->item.value);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  /*******************************************************************
+       Updates through fn(V&). Readers may hold the current node, so
+       fn is applied to a copy that replaces it (one hash and probe).
+  ********************************************************************/
+  /* Applies fn if key is present; returns whether it was */
+  template <class F>
+  bool modify(const K& key, F fn){
+    return modify(HashedKey<K>(key), fn);
+  }
+
+  template <class Q, class F>
+  bool modify(const HashedKey<Q>& key, F fn){
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    table_t* table = table_.load();
+    if (table == NULL){ return false; }
+    size_t hash = key.hash();
+    std::atomic<node_t*>& head = table->buckets[hash%table->capacity];
+    node_t* target = find_node(head.load(), hash, key.key());
+    if (target == NULL){ return false; }
+    value_t item(target->item);
+    fn(item.value);
+    replace(head, target, new node_t(item, target->next));
+    return true;
+  }
+
+  /* Applies fn to the value of key, default constructing it first if absent */
+  template <class F>
+  void upsert(const K& key, F fn){
+    upsert(HashedKey<K>(key), fn);
+  }
+
+  template <class F>
+  void upsert(const HashedKey<K>& hkey, F fn){
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    if (size_*2 >= capacity()){
+      resize();
+    }
+    size_t hash = hkey.hash();
+    const K& key = hkey.key();
+    table_t* table = table_.load();
+    std::atomic<node_t*>& head = table->buckets[hash%table->capacity];
+    node_t* target = find_node(head.load(), hash, key);
+    value_t item = (target == NULL) ? value_t(hash, key, V()) : target->item;
+    fn(item.value);
+    if (target == NULL){
+      head.store(new node_t(item, head.load()));
+      ++size_;
+      return;
+    }
+    replace(head, target, new node_t(item, target->next));
+  }
+
+  /***********************************************************************
+
+   ***********************************************************************/
+  iterator begin() const {
+    return iterator(table_.load(), 0);
+  }
+
+  iterator end() const {
+    table_t* table = table_.load();
+    return iterator(table, table == NULL ? 0 : table->capacity);
+  }
+
+  /***********************************************************************
+       Overloaded [] operator. This should only be used if the key is
+       known to be in the hash_table. Otherwise use find.
+       Returns a copy: a reference could outlive the reader's epoch.
+   ***********************************************************************/
+  V operator[](const K& key) const {
+    return (*this)[HashedKey<K>(key)];
+  }
+
+  template <class Q>
+  V operator[](const HashedKey<Q>& key) const {
+    EpochGuard guard(*epochs_);
+    const node_t* node = lookup(key);
+    if (node == NULL){ return V(); } /* bogus value */
+    return node->item.value;
+  }
+
+ private:
+  std::atomic<table_t*> table_;
+  size_t size_;                   /* Only read/written by writers */
+  EpochManager* epochs_;          /* Pointer so that tables can be moved */
+  std::mutex writer_mutex_;
+
+  size_t capacity() const {
+    table_t* table = table_.load();
+    return (table == NULL) ? 0 : table->capacity;
+  }
+
+  static void free_nodes(table_t* table){
+    for (size_t i = 0; i < table->capacity; ++i){
+      node_t* node = table->buckets[i].load();
+      while (node != NULL){
+	node_t* next = node->next;
+	delete node;
+	node = next;
+      }
+    }
+  }
+
+  template <class Q>
+  static node_t* find_node(node_t* node, size_t hash, const Q& key){
+    for (; node != NULL; node = node->next){
+      if (node->item.hash == hash && node->item.key == key){
+	return node;
+      }
+    }
+    return NULL;
+  }
+
+  /* Caller must be inside an EpochGuard */
+  template <class Q>
+  const node_t* lookup(const HashedKey<Q>& key) const {
+    table_t* table = table_.load();
+    if (table == NULL){ return NULL; }
+    size_t hash = key.hash();
+    return find_node(table->buckets[hash%table->capacity].load(), hash, key.key());
+  }
+
+  /* Publishes a copy of the chain in front of target followed by tail, then retires
+     target and the nodes that were copied */
+  void replace(std::atomic<node_t*>& head, node_t* target, node_t* tail){
+    node_t* first = head.load();
+    node_t* chain = copy_prefix(first, target, tail);
+    head.store(chain);
+    while (first != target){
+      node_t* next = first->next; /* retire may free first right away */
+      epochs_->retire(first);
+      first = next;
+    }
+    epochs_->retire(target);
+  }
+
+  static node_t* copy_prefix(node_t* node, node_t* target, node_t* tail){
+    if (node == target){ return tail; }
+    return new node_t(node->item, copy_prefix(node->next, target, tail));
+  }
+
+  /* Rebuilds every chain into a table twice the size, publishes it, and retires the
+     old table and its nodes as a unit */
+  void resize(){
+    size_t size = 2*size_ + 1;
+    if (size < 16){
+      size = 16;
+    }
+    table_t* old_table = table_.load();
+    table_t* table = new table_t(size);
+    if (old_table != NULL){
+      for (size_t i = 0; i < old_table->capacity; ++i){
+	for (node_t* node = old_table->buckets[i].load(); node != NULL; node = node->next){
+	  std::atomic<node_t*>& head = table->buckets[node->item.hash%size];
+	  head.store(new node_t(node->item, head.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+	}
+      }
+    }
+    table_.store(table);
+    if (old_table != NULL){
+      epochs_->retire(new retired_table_t(old_table));
+    }
+  }
+};
+
+#endif
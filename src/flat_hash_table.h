@@ -0,0 +1,523 @@
+/******************************************************************************************
+    Description: An open addressing (flat) hash_table with the same interface as HashTable.
+                 Every slot lives in one contiguous array next to an array of control bytes.
+                 A control byte is either EMPTY, DELETED, or the low 7 bits of the hash of the
+                 key stored in that slot. Lookups compare a whole group of GROUP_WIDTH
+                 control bytes at once (SSE2 when available) so that a find usually touches a
+                 single line of control bytes and a single slot.
+                 Slots are raw storage; only full slots hold constructed entries.
+                 Like HashTable, resizing is incremental: the old arrays are kept until every
+                 insert/remove has moved MIGRATE_SLOTS of them over, and lookups check both.
+                 Every operation also accepts a HashedKey (hashed_key.h) in place of the key.
+                 KEY_TYPE must be hashable with KeyHash<KEY_TYPE>{}.
+
+ ******************************************************************************************/
+#include "hashed_key.h"
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef CM_FLAT_HASH_TABLE
+#define CM_FLAT_HASH_TABLE
+
+template <class K, class V>
+class FlatHashTable {
+  typedef int8_t ctrl_t;
+  static const ctrl_t EMPTY = -128;     /* 0b10000000 */
+  static const ctrl_t DELETED = -2;     /* 0b11111110 */
+  static const size_t GROUP_WIDTH = 16; /* Control bytes compared at once */
+  static const size_t MIGRATE_SLOTS = 32; /* Old slots moved per insert/remove */
+
+ public:
+  /* Type of values for the hash_table */
+  struct value_t{
+    value_t() : hash(0) {}
+    value_t(size_t h, const K& k, const V& v) : hash(h), key(k), value(v) {}
+    size_t hash;
+    K key;
+    V value;
+  };
+
+  /**********************************************************************
+                Iterator and Constant Iterator Types
+  **********************************************************************/
+  class const_iterator;
+  class iterator {
+    const ctrl_t* ctrl_;
+    value_t* slots_;
+    size_t index_;
+    size_t size_;
+  public:
+    iterator() : ctrl_(NULL), slots_(NULL), index_(0), size_(0) {}
+    iterator(const ctrl_t* ctrl, value_t* slots, size_t index, size_t size) : ctrl_(ctrl), slots_(slots), index_(index), size_(size) { skip(); }
+    iterator& operator++() {
+      if (index_ == size_) return *this;
+      ++index_;
+      skip();
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator tmp(*this); ++(*this); return tmp;
+    }
+    bool operator ==(const iterator& it) { return (slots_ == it.slots_) && (index_ == it.index_); }
+    bool operator !=(const iterator& it) { return !((*this) == it); }
+    const value_t& operator*() const { return slots_[index_]; }
+    value_t& operator*() { return slots_[index_]; }
+    friend const_iterator;
+  private:
+    void skip() { while (index_ < size_ && ctrl_[index_] < 0) ++index_; }
+  };
+
+  class const_iterator {
+    const ctrl_t* ctrl_;
+    const value_t* slots_;
+    size_t index_;
+    size_t size_;
+  public:
+    const_iterator() : ctrl_(NULL), slots_(NULL), index_(0), size_(0) {}
+    const_iterator(const ctrl_t* ctrl, const value_t* slots, size_t index, size_t size) : ctrl_(ctrl), slots_(slots), index_(index), size_(size) { skip(); }
+    const_iterator(const iterator& it) : ctrl_(it.ctrl_), slots_(it.slots_), index_(it.index_), size_(it.size_) {}
+    const_iterator& operator++() {
+      if (index_ == size_) return *this;
+      ++index_;
+      skip();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator tmp(*this); ++(*this); return tmp;
+    }
+    bool operator ==(const const_iterator& it) { return (slots_ == it.slots_) && (index_ == it.index_); }
+    bool operator !=(const const_iterator& it) { return !((*this) == it); }
+    const value_t& operator*() const { return slots_[index_]; }
+  private:
+    void skip() { while (index_ < size_ && ctrl_[index_] < 0) ++index_; }
+  };
+
+  /* Return Type of the find functionality */
+  struct find_t{
+    find_t() : found(false) {}
+    find_t(const V& v) : found(true), value(v) {}
+    bool found;
+    V value;
+  };
+
+  /************************************************************************
+             Constructors, Destructors, and Assigment Operators
+   ************************************************************************/
+  /* Default Constructor */
+  FlatHashTable() : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0), deleted_(0), old_ctrl_(NULL), old_slots_(NULL), old_capacity_(0), migrated_(0) {}
+
+  /* Copy Constructor (the copy is fully migrated) */
+  FlatHashTable(const FlatHashTable& other) : FlatHashTable() {
+    if (other.size_ == 0) return;
+    allocate(capacity_for(other.size_));
+    copy_from(other.ctrl_, other.slots_, other.capacity_, 0);
+    copy_from(other.old_ctrl_, other.old_slots_, other.old_capacity_, other.migrated_);
+  }
+
+  /* Move Constructor */
+  FlatHashTable(FlatHashTable&& other) noexcept : FlatHashTable() {
+    steal(other);
+  }
+
+  /* Destructor */
+  ~FlatHashTable() noexcept {
+    release(ctrl_, slots_, capacity_, 0);
+    release(old_ctrl_, old_slots_, old_capacity_, migrated_);
+  }
+
+  /* Copy Assignment */
+  FlatHashTable& operator = (const FlatHashTable& other){
+    FlatHashTable tmp(other);
+    (*this) = std::move(tmp);
+    return *this;
+  }
+
+  /* Move Assignment */
+  FlatHashTable& operator = (FlatHashTable&& other) noexcept {
+    release(ctrl_, slots_, capacity_, 0);
+    release(old_ctrl_, old_slots_, old_capacity_, migrated_);
+    steal(other);
+    return *this;
+  }
+
+  /*******************************************************************
+              Insert, Remove, and Find operations
+  ********************************************************************/
+  void insert(const K& key, const V& val){
+    insert(HashedKey<K>(key), val);
+  }
+
+  void insert(const HashedKey<K>& hkey, const V& val){
+    migrate();
+    size_t hash = mix(hkey.hash());
+    const K& key = hkey.key();
+    value_t* item = lookup(hash, key);
+    if (item != NULL){
+      item->value = val;
+      return;
+    }
+    if ((size_ + deleted_ + 1) * 8 > capacity_ * 7){
+      resize();
+    }
+    size_t index = find_free(ctrl_, capacity_, hash);
+    if (ctrl_[index] == DELETED){
+      --deleted_;
+    }
+    new (&slots_[index]) value_t(hash, key, val);
+    set_ctrl(ctrl_, capacity_, index, h2(hash));
+    ++size_;
+  }
+
+  void remove(const K& key){
+    remove(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  void remove(const HashedKey<Q>& hkey){
+    if (capacity_ == 0){ return; }
+    migrate();
+    size_t hash = mix(hkey.hash());
+    const Q& key = hkey.key();
+    size_t index = find_index(ctrl_, slots_, capacity_, hash, key);
+    if (index != capacity_){
+      slots_[index].~value_t();
+      set_ctrl(ctrl_, capacity_, index, DELETED);
+      ++deleted_;
+      --size_;
+      return;
+    }
+    if (old_ctrl_ == NULL){ return; }
+    index = find_index(old_ctrl_, old_slots_, old_capacity_, hash, key);
+    if (index != old_capacity_){
+      old_slots_[index].~value_t();
+      set_ctrl(old_ctrl_, old_capacity_, index, DELETED);
+      --size_;
+    }
+  }
+
+  find_t find(const K& key) const {
+    return find(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  find_t find(const HashedKey<Q>& key) const {
+    value_t* item = lookup(mix(key.hash()), key.key());
+    if (item == NULL){ return find_t(); }
+    return find_t(item->value);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  /*******************************************************************
+       In place updates: fn(V&) is applied to the stored value after a
+       single hash and probe, so no copy of the value is made.
+  ********************************************************************/
+  /* Applies fn if key is present; returns whether it was */
+  template <class F>
+  bool modify(const K& key, F fn){
+    return modify(HashedKey<K>(key), fn);
+  }
+
+  template <class Q, class F>
+  bool modify(const HashedKey<Q>& key, F fn){
+    value_t* item = lookup(mix(key.hash()), key.key());
+    if (item == NULL){ return false; }
+    fn(item->value);
+    return true;
+  }
+
+  /* Applies fn to the value of key, default constructing it first if absent */
+  template <class F>
+  void upsert(const K& key, F fn){
+    upsert(HashedKey<K>(key), fn);
+  }
+
+  template <class F>
+  void upsert(const HashedKey<K>& hkey, F fn){
+    migrate();
+    size_t hash = mix(hkey.hash());
+    const K& key = hkey.key();
+    value_t* item = lookup(hash, key);
+    if (item == NULL){
+      if ((size_ + deleted_ + 1) * 8 > capacity_ * 7){
+	resize();
+      }
+      size_t index = find_free(ctrl_, capacity_, hash);
+      if (ctrl_[index] == DELETED){
+	--deleted_;
+      }
+      item = new (&slots_[index]) value_t(hash, key, V());
+      set_ctrl(ctrl_, capacity_, index, h2(hash));
+      ++size_;
+    }
+    fn(item->value);
+  }
+
+  /***********************************************************************
+
+   ***********************************************************************/
+  iterator begin() const {
+    /* Iteration only walks the new slots so finish any pending migration first */
+    const_cast<FlatHashTable*>(this)->finish_migration();
+    return iterator(ctrl_, slots_, 0, capacity_);
+  }
+
+  iterator end() const {
+    return iterator(ctrl_, slots_, capacity_, capacity_);
+  }
+
+  /***********************************************************************
+       Overloaded [] operators. These should only be used if the key is
+       known to be in the hash_table. Otherwise use find.
+   ***********************************************************************/
+  const V& operator[](const K& key) const {
+    return (*this)[HashedKey<K>(key)];
+  }
+
+  V& operator[](const K& key) {
+    return (*this)[HashedKey<K>(key)];
+  }
+
+  /* A missing key reads as V() */
+  template <class Q>
+  const V& operator[](const HashedKey<Q>& key) const {
+    static const V missing = V();
+    value_t* item = lookup(mix(key.hash()), key.key());
+    if (item == NULL){ return missing; }
+    return item->value;
+  }
+
+  /* key must be present (use insert / upsert / modify otherwise) */
+  template <class Q>
+  V& operator[](const HashedKey<Q>& key) {
+    value_t* item = lookup(mix(key.hash()), key.key());
+    assert(item != NULL);
+    return item->value;
+  }
+
+ private:
+  ctrl_t* ctrl_;     /* capacity_ + GROUP_WIDTH bytes; the tail mirrors the first group */
+  value_t* slots_;
+  size_t capacity_;  /* 0 or a power of 2 >= GROUP_WIDTH */
+  size_t size_;
+  size_t deleted_;   /* Tombstones; they count against the load factor */
+  ctrl_t* old_ctrl_; /* Arrays still being migrated (NULL if none) */
+  value_t* old_slots_;
+  size_t old_capacity_;
+  size_t migrated_;  /* old slots [0, migrated_) have been moved over */
+
+  /* std::hash is the identity for integers (our query ids are sequential),
+     so mix the bits before splitting them into a probe start and a fragment */
+  static size_t mix(size_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static ctrl_t h2(size_t hash) { return (ctrl_t)(hash & 0x7f); }
+  static size_t h1(size_t hash) { return hash >> 7; }
+
+  /* Bitmask of the positions in the group starting at ctrl whose byte equals c */
+  static uint32_t match(const ctrl_t* ctrl, ctrl_t c){
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; ++i){
+      if (ctrl[i] == c) mask |= (1u << i);
+    }
+    return mask;
+#endif
+  }
+
+  /* Bitmask of the positions in the group starting at ctrl that are EMPTY or DELETED */
+  static uint32_t match_free(const ctrl_t* ctrl){
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return (uint32_t)_mm_movemask_epi8(group); /* sign bit is only set for EMPTY/DELETED */
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_WIDTH; ++i){
+      if (ctrl[i] < 0) mask |= (1u << i);
+    }
+    return mask;
+#endif
+  }
+
+  static size_t lowest_bit(uint32_t mask){
+    return __builtin_ctz(mask);
+  }
+
+  /* Keeps the mirrored tail in sync so an unaligned group load never wraps */
+  static void set_ctrl(ctrl_t* ctrl, size_t capacity, size_t index, ctrl_t c){
+    ctrl[index] = c;
+    if (index < GROUP_WIDTH){
+      ctrl[capacity + index] = c;
+    }
+  }
+
+  /* Index of key in slots or capacity if key is not in the table.
+     Probes groups in triangular steps which visits every group of a power of 2 table. */
+  template <class Q>
+  static size_t find_index(const ctrl_t* ctrl, const value_t* slots, size_t capacity, size_t hash, const Q& key){
+    if (capacity == 0){ return capacity; }
+    size_t mask = capacity - 1;
+    size_t pos = h1(hash) & mask;
+    ctrl_t frag = h2(hash);
+    for (size_t step = GROUP_WIDTH; ; step += GROUP_WIDTH){
+      const ctrl_t* group = ctrl + pos;
+      for (uint32_t m = match(group, frag); m != 0; m &= m - 1){
+	size_t index = (pos + lowest_bit(m)) & mask;
+	if (slots[index].hash == hash && slots[index].key == key){
+	  return index;
+	}
+      }
+      if (match(group, EMPTY) != 0){
+	return capacity;
+      }
+      pos = (pos + step) & mask;
+    }
+  }
+
+  /* First EMPTY or DELETED slot along the probe sequence of hash */
+  static size_t find_free(const ctrl_t* ctrl, size_t capacity, size_t hash){
+    size_t mask = capacity - 1;
+    size_t pos = h1(hash) & mask;
+    for (size_t step = GROUP_WIDTH; ; step += GROUP_WIDTH){
+      uint32_t m = match_free(ctrl + pos);
+      if (m != 0){
+	return (pos + lowest_bit(m)) & mask;
+      }
+      pos = (pos + step) & mask;
+    }
+  }
+
+  /* Entry for key in the new or the old slots, NULL if key is absent */
+  template <class Q>
+  value_t* lookup(size_t hash, const Q& key) const {
+    size_t index = find_index(ctrl_, slots_, capacity_, hash, key);
+    if (index != capacity_){ return &slots_[index]; }
+    if (old_ctrl_ == NULL){ return NULL; }
+    index = find_index(old_ctrl_, old_slots_, old_capacity_, hash, key);
+    if (index != old_capacity_){ return &old_slots_[index]; }
+    return NULL;
+  }
+
+  /* Smallest power of 2 table that holds n entries at under half load */
+  static size_t capacity_for(size_t n){
+    size_t size = GROUP_WIDTH;
+    while (size * 7 < (n + 1) * 16){
+      size *= 2;
+    }
+    return size;
+  }
+
+  void allocate(size_t size){
+    ctrl_ = new ctrl_t[size + GROUP_WIDTH];
+    std::memset(ctrl_, (unsigned char)EMPTY, size + GROUP_WIDTH);
+    slots_ = static_cast<value_t*>(::operator new(size * sizeof(value_t)));
+    capacity_ = size;
+    deleted_ = 0;
+  }
+
+  /* Destroys the full slots in [from, capacity) and frees both arrays */
+  static void release(ctrl_t* ctrl, value_t* slots, size_t capacity, size_t from){
+    if (ctrl == NULL){ return; }
+    for (size_t i = from; i < capacity; ++i){
+      if (ctrl[i] >= 0){
+	slots[i].~value_t();
+      }
+    }
+    delete[] ctrl;
+    ::operator delete(slots);
+  }
+
+  /* Inserts copies of the full slots in [from, capacity) (keys are known to be unique) */
+  void copy_from(const ctrl_t* ctrl, const value_t* slots, size_t capacity, size_t from){
+    if (ctrl == NULL){ return; }
+    for (size_t i = from; i < capacity; ++i){
+      if (ctrl[i] >= 0){
+	size_t index = find_free(ctrl_, capacity_, slots[i].hash);
+	new (&slots_[index]) value_t(slots[i]);
+	set_ctrl(ctrl_, capacity_, index, ctrl[i]);
+	++size_;
+      }
+    }
+  }
+
+  void steal(FlatHashTable& other){
+    ctrl_ = other.ctrl_;
+    slots_ = other.slots_;
+    capacity_ = other.capacity_;
+    size_ = other.size_;
+    deleted_ = other.deleted_;
+    old_ctrl_ = other.old_ctrl_;
+    old_slots_ = other.old_slots_;
+    old_capacity_ = other.old_capacity_;
+    migrated_ = other.migrated_;
+    other.ctrl_ = other.old_ctrl_ = NULL;
+    other.slots_ = other.old_slots_ = NULL;
+    other.capacity_ = other.size_ = other.deleted_ = other.old_capacity_ = other.migrated_ = 0;
+  }
+
+  /* Move up to n old slots into the new slots */
+  void migrate(size_t n = MIGRATE_SLOTS){
+    if (old_ctrl_ == NULL){ return; }
+    for (; n != 0 && migrated_ < old_capacity_; --n, ++migrated_){
+      if (old_ctrl_[migrated_] < 0){ continue; }
+      value_t& item = old_slots_[migrated_];
+      size_t index = find_free(ctrl_, capacity_, item.hash);
+      if (ctrl_[index] == DELETED){
+	--deleted_;
+      }
+      new (&slots_[index]) value_t(std::move(item));
+      set_ctrl(ctrl_, capacity_, index, old_ctrl_[migrated_]);
+      item.~value_t();
+      set_ctrl(old_ctrl_, old_capacity_, migrated_, DELETED);
+    }
+    if (migrated_ == old_capacity_){
+      delete[] old_ctrl_;
+      ::operator delete(old_slots_);
+      old_ctrl_ = NULL;
+      old_slots_ = NULL;
+      old_capacity_ = migrated_ = 0;
+    }
+  }
+
+  void finish_migration(){
+    migrate(old_capacity_);
+  }
+
+  /* Starts a migration into new arrays: bigger when mostly full of live entries,
+     the same size when mostly tombstones (which are dropped by the move) */
+  void resize(){
+    finish_migration();
+    size_t size = capacity_for(size_);
+    if (size < capacity_){
+      size = capacity_;
+    }
+    old_ctrl_ = ctrl_;
+    old_slots_ = slots_;
+    old_capacity_ = capacity_;
+    migrated_ = 0;
+    allocate(size);
+    if (old_ctrl_ == NULL){
+      old_capacity_ = 0;
+    }
+  }
+};
+
+#endif
@@ -7,38 +7,106 @@
     Description: A simple hash_table with arbitrary key types (using std::hash<KEY_TYPE>{} as
                  the hash function). Therefore KEY_TYPE must be a type hashable with
                  std::hash
+                 Resizing is incremental: the old bucket array is kept alongside the new one
+                 and every insert/remove moves MIGRATE_BUCKETS of the old buckets over, so no
+                 single operation pays for rehashing the whole table. Lookups check both.
+                 The next bucket array is likewise built a few buckets per insert ahead of
+                 time so that no operation pays for allocating and initializing it either.
+                 Every operation also accepts a HashedKey (hashed_key.h) in place of the key,
+                 so callers can hash a key once and reuse it; lookups accept a HashedKey of
+                 any type comparable to KEY_TYPE (e.g. a KeyView for std::string keys).
+                 The table is allocator aware: every bucket array of entries is allocated with
+                 ALLOC (rebound to the entry type), and keys that take an allocator (e.g.
+                 SlabString) are built with it too, so a SlabAllocator puts both entries and
+                 key bytes in one slab pool (slab_allocator.h).
 
  ******************************************************************************************/
+#include "hashed_key.h"
+#include <cstdint>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 #ifndef CM_HASH_TABLE
 #define CM_HASH_TABLE
 
-template <class K, class V>
+template <class K, class V, class Alloc = std::allocator<char>>
 class HashTable {
  public:
   /* Type of values for the hash_table */
   struct value_t{
     value_t() : hash(0) {}
     value_t(size_t h, const K& k, const V& v) : hash(h), key(k), value(v) {}
+    value_t(size_t h, K&& k, const V& v) : hash(h), key(std::move(k)), value(v) {}
     size_t hash;
     K key;
     V value;
   };
 
+ private:
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<value_t> value_alloc_t;
+
+  /* A bucket is a small growable array of entries. It doesn't keep a copy of the
+     allocator (the table passes its own in), so an empty bucket is just 16 bytes. */
+  class bucket_t {
+    value_t* items_;
+    uint32_t size_;
+    uint32_t capacity_;
+  public:
+    typedef value_t* iterator;
+    typedef const value_t* const_iterator;
+    bucket_t() : items_(NULL), size_(0), capacity_(0) {}
+    size_t size() const { return size_; }
+    value_t& operator[](size_t i) const { return items_[i]; }
+    value_t& back() const { return items_[size_-1]; }
+    iterator begin() const { return items_; }
+    iterator end() const { return items_ + size_; }
+    template <class U>
+    void push_back(value_alloc_t alloc, U&& item){
+      if (size_ == capacity_){
+	size_t capacity = (capacity_ == 0) ? 1 : 2*capacity_;
+	value_t* items = alloc.allocate(capacity);
+	for (size_t i = 0; i < size_; ++i){
+	  new (&items[i]) value_t(std::move(items_[i]));
+	  items_[i].~value_t();
+	}
+	if (items_ != NULL){ alloc.deallocate(items_, capacity_); }
+	items_ = items;
+	capacity_ = capacity;
+      }
+      new (&items_[size_]) value_t(std::forward<U>(item));
+      ++size_;
+    }
+    void pop_back(){
+      items_[--size_].~value_t();
+    }
+    /* Destroys the entries and frees the array */
+    void release(value_alloc_t alloc){
+      for (size_t i = 0; i < size_; ++i){
+	items_[i].~value_t();
+      }
+      if (items_ != NULL){ alloc.deallocate(items_, capacity_); }
+      items_ = NULL;
+      size_ = capacity_ = 0;
+    }
+  };
+
+ public:
+
   /**********************************************************************
                 Iterator and Constant Iterator Types
   **********************************************************************/
   class const_iterator;
   class iterator {
-    std::vector<value_t>* items_;
+    bucket_t* items_;
     size_t index_;
     size_t size_;
-    typename std::vector<value_t>::iterator it_;
+    typename bucket_t::iterator it_;
   public:
     iterator() : items_(NULL), index_(0), size_(0) {}
-    iterator(std::vector<value_t>* items, size_t index, size_t size, typename std::vector<value_t>::iterator it) : items_(items), index_(index), size_(size), it_(it) {}
+    iterator(bucket_t* items, size_t index, size_t size, typename bucket_t::iterator it) : items_(items), index_(index), size_(size), it_(it) {}
     iterator(const iterator& it) : items_(it.items_), index_(it.index_), size_(it.size_), it_(it.it_) {}
     iterator& operator++() {
       if (index_ == size_) return *this;
@@ -60,26 +128,26 @@ class HashTable {
   };
 
   class const_iterator {
-    std::vector<value_t>* items_;
+    bucket_t* items_;
     size_t index_;
     size_t size_;
-    typename std::vector<value_t>::const_iterator it_;
+    typename bucket_t::const_iterator it_;
   public:
     const_iterator() : items_(NULL), index_(0), size_(0) {}
-    const_iterator(std::vector<value_t>* items, size_t index, size_t size, typename std::vector<value_t>::const_iterator it) : items_(items), index_(index), size_(size), it_(it) {}
+    const_iterator(bucket_t* items, size_t index, size_t size, typename bucket_t::const_iterator it) : items_(items), index_(index), size_(size), it_(it) {}
     const_iterator(const const_iterator& it) : items_(it.items_), index_(it.index_), size_(it.size_), it_(it.it_) {}
     const_iterator(const iterator& it) : items_(it.items_), index_(it.index_), size_(it.size_), it_(it.it_) {}
     const_iterator& operator++() {
       if (index_ == size_) return *this;
       if (++it_ != items_[index_].end()) return *this;
-      while (it_ == items_[index].end() && (index_+1) != size_){
+      while (it_ == items_[index_].end() && (index_+1) != size_){
 	it_ = items_[++index_].begin();
       }
       if (it_ == items_[index_].end()) { index_ = size_; }
       return *this;
     }
     const_iterator operator++(int) {
-      iterator tmp(*this); ++(*this); return tmp;
+      const_iterator tmp(*this); ++(*this); return tmp;
     }
     bool operator ==(const const_iterator& it) { return (items_ == it.items_) && (index_ == it.index_) && (it_ == it.it_); }
     bool operator !=(const const_iterator& it) { return !((*this) == it); }
@@ -98,26 +166,38 @@ class HashTable {
              Constructors, Destructors, and Assigment Operators
    ************************************************************************/
   /* Default Constructor */
-  HashTable() : vals_(NULL), size_(0), capacity_(0) {}
+  HashTable() : HashTable(Alloc()) {}
+
+  /* Entries (and keys that take an allocator) are allocated with alloc */
+  explicit HashTable(const Alloc& alloc) : vals_(NULL), capacity_(0), size_(0), old_vals_(NULL), old_capacity_(0), migrated_(0), next_vals_(NULL), next_capacity_(0), next_built_(0), alloc_(alloc) {}
   
-  /* Copy Constructor */
-  HashTable(const HashTable& other) : vals_(NULL), size_(other.size_), capacity_(other.capacity_) {
-    vals_ = new std::vector<value_t>[size_]();
-    for (size_t i = 0; i < size_; ++i){
-      vals_[i] = other.vals_[i];
+  /* Copy Constructor (the copy is fully migrated and shares other's allocator) */
+  HashTable(const HashTable& other) : HashTable(other.alloc_) {
+    if (other.vals_ == NULL) return;
+    capacity_ = other.capacity_;
+    vals_ = allocate(capacity_);
+    construct(vals_, 0, capacity_);
+    for (size_t i = 0; i < capacity_; ++i){
+      for (size_t j = 0; j < other.vals_[i].size(); ++j){
+	vals_[i].push_back(alloc_, other.vals_[i][j]);
+      }
     }
+    for (size_t i = other.migrated_; i < other.old_capacity_; ++i){
+      for (size_t j = 0; j < other.old_vals_[i].size(); ++j){
+	vals_[other.old_vals_[i][j].hash%capacity_].push_back(alloc_, other.old_vals_[i][j]);
+      }
+    }
+    size_ = other.size_;
   }
 
   /* Move Constructor */
-  HashTable(HashTable&& other) noexcept : vals_(other.vals_), size_(other.size_), capacity_(other.capacity_) {
-    other.vals_ = NULL;
+  HashTable(HashTable&& other) noexcept : HashTable() {
+    steal(other);
   }
 
   /* Destructor */
   ~HashTable() noexcept {
-    if (vals_ != NULL){
-      delete[] vals_;
-    }
+    release();
   }
 
   /* Copy Assignment */
@@ -129,13 +209,8 @@ class HashTable {
 
   /* Move Assignment */
   HashTable& operator = (HashTable && other) noexcept {
-    if (vals_ != NULL){
-      delete[] vals_;
-    }
-    vals_ = other.vals_;
-    size_ = other.size_;
-    capacity_ = other.capacity_;
-    other.vals_ = NULL;
+    release();
+    steal(other);
     return *this;
   }
 
@@ -144,50 +219,113 @@ class HashTable {
               Insert, Remove, and Find operations
   ********************************************************************/
   void insert(const K& key, const V& val){
+    insert(HashedKey<K>(key), val);
+  }
+
+  template <class Q>
+  void insert(const HashedKey<Q>& hkey, const V& val){
+    migrate();
+    size_t hash = hkey.hash();
+    const Q& key = hkey.key();
+    value_t* item = lookup(hash, key);
+    if (item != NULL){
+      item->value = val;
+      return;
+    }
     if (size_*2 >= capacity_){
       resize();
+    } else if (size_*4 >= capacity_){
+      prepare();
     }
-    size_t hash = hash_func(key);
-    size_t index = hash%capacity_;
-    for (size_t i = 0; i < vals_[index].size(); ++i){
-      if (vals_[index][i].hash == hash && vals_[index][i].key == key){
-	vals_[index][i].value = val;
-	return;
-      }
-    }
-    vals_[hash%capacity_].push_back(value_t(hash, key, val));
+    vals_[hash%capacity_].push_back(alloc_, value_t(hash, make_key(key), val));
     ++size_;
   }
 
   void remove(const K& key){
+    remove(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  void remove(const HashedKey<Q>& hkey){
     if (capacity_ == 0){ return; }
-    size_t hash = hash_func(key);
-    size_t index = hash%capacity_;
-    for (size_t i = 0; i < vals_[index].size(); ++i){
-      if (vals_[index][i].hash == hash && vals_[index][i].key == key){
-	vals_[index][i] = vals_[index][vals_[index].size()-1];
-	vals_[index].pop_back();
-	--size_;
-      }
+    migrate();
+    size_t hash = hkey.hash();
+    const Q& key = hkey.key();
+    if (remove_from(vals_[hash%capacity_], hash, key)){
+      return;
+    }
+    if (old_vals_ != NULL && hash%old_capacity_ >= migrated_){
+      remove_from(old_vals_[hash%old_capacity_], hash, key);
     }
   }
 
   find_t find(const K& key) const {
+    return find(HashedKey<K>(key));
+  }
+
+  template <class Q>
+  find_t find(const HashedKey<Q>& key) const {
     if (capacity_ == 0){ return find_t(); }
-    size_t hash = hash_func(key);
-    size_t index = hash%capacity_;
-    for (size_t i = 0; i < vals_[index].size(); ++i){
-      if (vals_[index][i].hash == hash && vals_[index][i].key == key){
-	return find_t(vals_[index][i].value);
+    value_t* item = lookup(key.hash(), key.key());
+    if (item == NULL){ return find_t(); }
+    return find_t(item->value);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  /*******************************************************************
+       In place updates: fn(V&) is applied to the stored value after a
+       single hash and probe, so no copy of the value is made.
+  ********************************************************************/
+  /* Applies fn if key is present; returns whether it was */
+  template <class F>
+  bool modify(const K& key, F fn){
+    return modify(HashedKey<K>(key), fn);
+  }
+
+  template <class Q, class F>
+  bool modify(const HashedKey<Q>& key, F fn){
+    if (capacity_ == 0){ return false; }
+    value_t* item = lookup(key.hash(), key.key());
+    if (item == NULL){ return false; }
+    fn(item->value);
+    return true;
+  }
+
+  /* Applies fn to the value of key, default constructing it first if absent */
+  template <class F>
+  void upsert(const K& key, F fn){
+    upsert(HashedKey<K>(key), fn);
+  }
+
+  template <class Q, class F>
+  void upsert(const HashedKey<Q>& hkey, F fn){
+    migrate();
+    size_t hash = hkey.hash();
+    const Q& key = hkey.key();
+    value_t* item = lookup(hash, key);
+    if (item == NULL){
+      if (size_*2 >= capacity_){
+	resize();
+      } else if (size_*4 >= capacity_){
+	prepare();
       }
+      bucket_t& bucket = vals_[hash%capacity_];
+      bucket.push_back(alloc_, value_t(hash, make_key(key), V()));
+      ++size_;
+      item = &bucket.back();
     }
-    return find_t();
+    fn(item->value);
   }
 
   /***********************************************************************
 
    ***********************************************************************/
   iterator begin() const {
+    /* Iteration only walks the new buckets so finish any pending migration first */
+    const_cast<HashTable*>(this)->finish_migration();
     for (size_t i = 0; i < capacity_; ++i){
       if (vals_[i].size() != 0){
 	return iterator(vals_, i, capacity_, vals_[i].begin());
@@ -198,7 +336,7 @@ class HashTable {
 
   iterator end() const {
     if (capacity_ == 0) {
-      return iterator(vals_, capacity_, capacity_, std::vector<value_t>().end());
+      return iterator(vals_, capacity_, capacity_, NULL);
     }
     return iterator(vals_, capacity_, capacity_, vals_[capacity_-1].end());
   }
@@ -208,35 +346,188 @@ class HashTable {
        known to be in the hash_table. Otherwise use find.
    ***********************************************************************/
   const V& operator[](const K& key) const {
+    return (*this)[HashedKey<K>(key)];
+  }
+
+  V& operator[](const K& key) {
+    return (*this)[HashedKey<K>(key)];
+  }
+
+  template <class Q>
+  const V& operator[](const HashedKey<Q>& key) const {
     if (capacity_ == 0){ return ref_val_; }
-    size_t hash = hash_func(key);
-    size_t index = hash%capacity_;
-    for (size_t i = 0; i < vals_[index].size(); ++i){
-      if (vals_[index][i].hash == hash && vals_[index][i].key == key){
-	return vals_[index][i].value;
-      }
-    }
-    return ref_val_; /* bogus value */
+    value_t* item = lookup(key.hash(), key.key());
+    if (item == NULL){ return ref_val_; } /* bogus value */
+    return item->value;
   }
   
-  V& operator[](const K& key) {
+  template <class Q>
+  V& operator[](const HashedKey<Q>& key) {
     if (capacity_ == 0){ return ref_val_; }
-    size_t hash = hash_func(key);
-    size_t index = hash%capacity_;
-    for (size_t i = 0; i < vals_[index].size(); ++i){
-      if (vals_[index][i].hash == hash && vals_[index][i].key == key){
-	return vals_[index][i].value;
-      }
-    }
-    return ref_val_; /* bogus value */
+    value_t* item = lookup(key.hash(), key.key());
+    if (item == NULL){ return ref_val_; } /* bogus value */
+    return item->value;
   }
 
  private:
-  std::vector<value_t>* vals_;
+  static const size_t MIGRATE_BUCKETS = 8; /* Old buckets moved per insert/remove */
+  static const size_t PREPARE_BUCKETS = 16; /* Next buckets constructed per insert */
+
+  /* Bucket arrays are raw storage so that constructing and destroying their buckets
+     can be spread over many operations instead of happening inside a single resize */
+  bucket_t* vals_;       /* [0, capacity_) constructed */
   V ref_val_;
   size_t capacity_;
   size_t size_;
-  std::hash<K> hash_func;
+  bucket_t* old_vals_;   /* Buckets still being migrated (NULL if none), [migrated_, old_capacity_) constructed */
+  size_t old_capacity_;
+  size_t migrated_;
+  bucket_t* next_vals_;  /* Buckets for the next resize (NULL if none), [0, next_built_) constructed */
+  size_t next_capacity_;
+  size_t next_built_;
+  Alloc alloc_;
+
+  static bucket_t* allocate(size_t n){
+    return static_cast<bucket_t*>(::operator new(n * sizeof(bucket_t)));
+  }
+
+  static void construct(bucket_t* buckets, size_t from, size_t to){
+    for (size_t i = from; i < to; ++i){
+      new (&buckets[i]) bucket_t();
+    }
+  }
+
+  void destroy(bucket_t* buckets, size_t from, size_t to){
+    if (buckets == NULL){ return; }
+    for (size_t i = from; i < to; ++i){
+      buckets[i].release(alloc_);
+    }
+    ::operator delete(buckets);
+  }
+
+  void release(){
+    destroy(vals_, 0, capacity_);
+    destroy(old_vals_, migrated_, old_capacity_);
+    destroy(next_vals_, 0, next_built_);
+  }
+
+  void steal(HashTable& other){
+    vals_ = other.vals_;
+    capacity_ = other.capacity_;
+    size_ = other.size_;
+    old_vals_ = other.old_vals_;
+    old_capacity_ = other.old_capacity_;
+    migrated_ = other.migrated_;
+    next_vals_ = other.next_vals_;
+    next_capacity_ = other.next_capacity_;
+    next_built_ = other.next_built_;
+    alloc_ = other.alloc_;
+    other.vals_ = other.old_vals_ = other.next_vals_ = NULL;
+    other.capacity_ = other.size_ = other.old_capacity_ = other.migrated_ = 0;
+    other.next_capacity_ = other.next_built_ = 0;
+  }
+
+  /* Builds the stored key from a lookup key; keys that take an allocator get alloc_ */
+  template <class Q>
+  K make_key(const Q& key) const {
+    return make_key(key, std::uses_allocator<K, Alloc>());
+  }
+
+  template <class Q>
+  K make_key(const Q& key, std::true_type) const {
+    return K(key.begin(), key.end(), typename K::allocator_type(alloc_));
+  }
+
+  template <class Q>
+  K make_key(const Q& key, std::false_type) const {
+    return K(key);
+  }
+
+  /* Entry for key in the new or the old buckets, NULL if key is absent */
+  template <class Q>
+  value_t* lookup(size_t hash, const Q& key) const {
+    if (capacity_ == 0){ return NULL; }
+    bucket_t& bucket = vals_[hash%capacity_];
+    for (size_t i = 0; i < bucket.size(); ++i){
+      if (bucket[i].hash == hash && bucket[i].key == key){
+	return &bucket[i];
+      }
+    }
+    if (old_vals_ == NULL || hash%old_capacity_ < migrated_){ return NULL; }
+    bucket_t& old_bucket = old_vals_[hash%old_capacity_];
+    for (size_t i = 0; i < old_bucket.size(); ++i){
+      if (old_bucket[i].hash == hash && old_bucket[i].key == key){
+	return &old_bucket[i];
+      }
+    }
+    return NULL;
+  }
+
+  template <class Q>
+  bool remove_from(bucket_t& bucket, size_t hash, const Q& key){
+    for (size_t i = 0; i < bucket.size(); ++i){
+      if (bucket[i].hash == hash && bucket[i].key == key){
+	bucket[i] = std::move(bucket[bucket.size()-1]);
+	bucket.pop_back();
+	--size_;
+	return true;
+      }
+    }
+    return false;
+  }
+
+  /* Move up to n old buckets into the new buckets */
+  void migrate(size_t n = MIGRATE_BUCKETS){
+    if (old_vals_ == NULL){ return; }
+    for (; n != 0 && migrated_ < old_capacity_; --n, ++migrated_){
+      bucket_t& bucket = old_vals_[migrated_];
+      for (size_t j = 0; j < bucket.size(); ++j){
+	vals_[bucket[j].hash%capacity_].push_back(alloc_, std::move(bucket[j]));
+      }
+      bucket.release(alloc_);
+    }
+    if (migrated_ == old_capacity_){
+      destroy(old_vals_, migrated_, old_capacity_);
+      old_vals_ = NULL;
+      old_capacity_ = migrated_ = 0;
+    }
+  }
+
+  void finish_migration(){
+    migrate(old_capacity_);
+  }
+
+  /* Constructs PREPARE_BUCKETS more of the bucket array used by the next resize.
+     Starting at half the resize threshold leaves enough inserts to build all of it. */
+  void prepare(size_t n = PREPARE_BUCKETS){
+    if (next_vals_ == NULL){
+      next_capacity_ = prime_at_least(capacity_+1);
+      if (next_capacity_ == 0){
+	next_capacity_ = next_prime(capacity_+2);
+      }
+      next_vals_ = allocate(next_capacity_);
+      next_built_ = 0;
+    }
+    size_t to = (next_capacity_ - next_built_ < n) ? next_capacity_ : next_built_ + n;
+    construct(next_vals_, next_built_, to);
+    next_built_ = to;
+  }
+
+  /* Roughly doubling primes; avoids trial division while resizing */
+  static size_t prime_at_least(size_t n){
+    static const size_t primes[] = {
+      2ul, 5ul, 11ul, 23ul, 53ul, 97ul, 193ul, 389ul, 769ul, 1543ul, 3079ul, 6151ul,
+      12289ul, 24593ul, 49157ul, 98317ul, 196613ul, 393241ul, 786433ul, 1572869ul,
+      3145739ul, 6291469ul, 12582917ul, 25165843ul, 50331653ul, 100663319ul,
+      201326611ul, 402653189ul, 805306457ul, 1610612741ul, 3221225473ul, 4294967291ul
+    };
+    for (size_t i = 0; i < sizeof(primes)/sizeof(primes[0]); ++i){
+      if (primes[i] >= n){
+	return primes[i];
+      }
+    }
+    return 0;
+  }
 
   /* Functions used to resize the hash_table */
   bool is_prime(size_t n) const {
@@ -267,18 +558,20 @@ class HashTable {
     return n;
   }
 
+  /* Starts a migration into the next (roughly doubled) bucket array. The previous
+     migration is always done by now: it needs capacity_/MIGRATE_BUCKETS inserts, far
+     fewer than the inserts that take size_*2 back up to capacity_. */
   void resize(){
-    size_t size = next_prime(2*size_+1);
-    std::vector<value_t>* tmp = new std::vector<value_t>[size]();
-    /* rehash the key value pairs based on key/hash */
-    for (size_t i = 0; i < capacity_; ++i){
-      for (size_t j = 0; j < vals_[i].size(); ++j){
-	tmp[vals_[i][j].hash%size].push_back(vals_[i][j]);
-      }
-    }
-    delete[] vals_;
-    vals_ = tmp;
-    capacity_ = size;
+    finish_migration();
+    prepare(0);               /* allocates it if the table grew before it was started */
+    prepare(next_capacity_);  /* normally already fully constructed */
+    old_vals_ = vals_;
+    old_capacity_ = capacity_;
+    migrated_ = 0;
+    vals_ = next_vals_;
+    capacity_ = next_capacity_;
+    next_vals_ = NULL;
+    next_capacity_ = next_built_ = 0;
   }
 };
 
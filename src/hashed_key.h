@@ -0,0 +1,100 @@
+/******************************************************************************************
+    Description: Keys that carry their hash with them.
+                 KeyHash<KEY_TYPE> is the hash every table uses. For std::string it hashes
+                 the bytes directly, so a KeyView (pointer + length into someone else's
+                 buffer) hashes the same as the std::string holding those bytes and can be
+                 used to look up a std::string key without building one.
+                 HashedKey<KEY_TYPE> pairs a reference to a key with its KeyHash. Tables
+                 accept it in place of the key, so a key that is used several times in one
+                 operation (and across stage / commit, where the hash is stored in the
+                 query) is hashed exactly once. The referenced key must outlive the handle.
+
+ ******************************************************************************************/
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+#ifndef CM_HASHED_KEY
+#define CM_HASHED_KEY
+
+/* A read only view of the bytes of a string key (a minimal std::string_view) */
+struct KeyView {
+  KeyView() : data(NULL), size(0) {}
+  KeyView(const char* d, size_t s) : data(d), size(s) {}
+  KeyView(const std::string& s) : data(s.data()), size(s.size()) {}
+  const char* begin() const { return data; }
+  const char* end() const { return data + size; }
+  const char* data;
+  size_t size;
+};
+
+inline bool operator ==(const std::string& a, const KeyView& b){
+  return a.size() == b.size && std::memcmp(a.data(), b.data, b.size) == 0;
+}
+
+inline bool operator ==(const KeyView& a, const std::string& b){
+  return b == a;
+}
+
+/* Murmur64A over len bytes: reads 8 bytes at a time so long keys stay cheap */
+inline size_t hash_bytes(const char* data, size_t len){
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = 0x8445d61a4e774912ULL ^ (len * m);
+  const char* end = data + (len & ~(size_t)7);
+  for (; data != end; data += 8){
+    uint64_t k;
+    std::memcpy(&k, data, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  size_t rest = len & 7;
+  if (rest != 0){ /* the last 1-7 bytes, little endian */
+    uint64_t tail = 0;
+    for (size_t i = rest; i-- > 0; ){
+      tail = (tail << 8) | (unsigned char)data[i];
+    }
+    h ^= tail;
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return (size_t)h;
+}
+
+/* Hash used by the tables; std::hash for everything but string keys */
+template <class K>
+struct KeyHash : std::hash<K> {};
+
+template <>
+struct KeyHash<std::string> {
+  size_t operator()(const std::string& key) const { return hash_bytes(key.data(), key.size()); }
+};
+
+template <>
+struct KeyHash<KeyView> {
+  size_t operator()(const KeyView& key) const { return hash_bytes(key.data, key.size); }
+};
+
+template <class K>
+class HashedKey {
+ public:
+  explicit HashedKey(const K& key) : key_(&key), hash_(KeyHash<K>()(key)) {}
+  /* hash must be KeyHash<K>()(key), e.g. saved from an earlier HashedKey */
+  HashedKey(const K& key, size_t hash) : key_(&key), hash_(hash) {}
+
+  const K& key() const { return *key_; }
+  size_t hash() const { return hash_; }
+
+ private:
+  const K* key_;
+  size_t hash_;
+};
+
+#endif
@@ -5,13 +5,18 @@
     Date:   March 27, 2017
 
     Description: A simple Key-Value storage (* Simple Interface over hash_table *)
+                 The underlying table defaults to the chained HashTable; any table with
+                 the same interface (e.g. FlatHashTable) may be used instead.
+                 Every operation also accepts a HashedKey (hashed_key.h) in place of the key.
+                 Any constructor argument is handed to the table (e.g. a SlabAllocator).
  ***********************************************************************************/
 #include "hash_table.h"
+#include "flat_hash_table.h"
 
 #ifndef CM_KEY_VALUE_STORE
 #define CM_KEY_VALUE_STORE
 
-template <class K, class V>
+template <class K, class V, class Table = HashTable<K, V>>
 class KeyValueStore{
  public:
   /*********************************************************
@@ -19,22 +24,25 @@ class KeyValueStore{
    *********************************************************/
   KeyValueStore(){}
 
+  template <class A>
+  explicit KeyValueStore(const A& alloc) : kv_table_(alloc) {}
+
   /*********************************************************
      Key Value Semantics Operations
    *********************************************************/
 
   /* KV find_t type is just the underlying hashtable find_t */
-  typedef typename HashTable<K, V>::find_t find_t;
-  typedef typename HashTable<K, V>::value_t value_t;
-  typedef typename HashTable<K, V>::iterator iterator;
-  typedef typename HashTable<K, V>::const_iterator const_iterator;
+  typedef typename Table::find_t find_t;
+  typedef typename Table::value_t value_t;
+  typedef typename Table::iterator iterator;
+  typedef typename Table::const_iterator const_iterator;
 
   find_t find(const K& key){
     return kv_table_.find(key);
   }
   
   V get(const K& key) {
-    return kv_table_[key];
+    return static_cast<const Table&>(kv_table_)[key]; /* A miss reads as V() */
   }
 
   void put(const K& key, const V& value){
@@ -45,6 +53,49 @@ class KeyValueStore{
     kv_table_.remove(key);
   }
 
+  /* The same operations on a key whose hash was already computed */
+  template <class Q>
+  find_t find(const HashedKey<Q>& key){
+    return kv_table_.find(key);
+  }
+
+  template <class Q>
+  V get(const HashedKey<Q>& key) {
+    return static_cast<const Table&>(kv_table_)[key]; /* A miss reads as V() */
+  }
+
+  template <class Q>
+  void put(const HashedKey<Q>& key, const V& value){
+    kv_table_.insert(key, value);
+  }
+
+  template <class Q>
+  void remove(const HashedKey<Q>& key){
+    kv_table_.remove(key);
+  }
+
+  /* Applies fn(V&) to the value of key in place; returns false if key is absent */
+  template <class F>
+  bool modify(const K& key, F fn){
+    return kv_table_.modify(key, fn);
+  }
+
+  template <class Q, class F>
+  bool modify(const HashedKey<Q>& key, F fn){
+    return kv_table_.modify(key, fn);
+  }
+
+  /* Applies fn(V&) to the value of key in place, inserting V() first if absent */
+  template <class F>
+  void upsert(const K& key, F fn){
+    kv_table_.upsert(key, fn);
+  }
+
+  template <class Q, class F>
+  void upsert(const HashedKey<Q>& key, F fn){
+    kv_table_.upsert(key, fn);
+  }
+
   iterator begin() const {
     return kv_table_.begin();
   }
@@ -54,7 +105,7 @@ class KeyValueStore{
   }
   
  private:
-  HashTable<K, V> kv_table_;
+  Table kv_table_;
 };
 
 #endif
@@ -10,16 +10,57 @@
 //#include "serversion.h" //testAQ
 #include "server_2paq.h"
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 using namespace std;
+static void usage(const char* name){
+  cerr << "Usage: " << name << " <address_of_local_machine> <port_number> <organizing_server_address> <port_number> [options]" << endl
+       << "  --threads <n>       rpc server threads (1)" << endl
+       << "  --batch <n>         Leader groups up to n writes per stage (1: no grouping)" << endl
+       << "  --pipeline          commits ride on a watermark instead of commit messages" << endl
+       << "  --commit-wait <ms>  a follower get on a dirty key waits this long for its commit (0)" << endl
+       << "  --tree              replicate down a binary tree of followers" << endl
+       << "  --quorum <n>|majority  commit once n followers acknowledge (0: all)" << endl
+       << "  --framed            replication traffic on the binary channel (port + " << CHANNEL_PORT_OFFSET << ")" << endl;
+}
 
 int main(int argc, char ** argv){
-  if (argc != 5){
-    cerr << "Usage: " << argv[0] << " <address_of_local_machine> <port_number> <organizing_server_address> <port_number> " << endl;
+  if (argc < 5){
+    usage(argv[0]);
+    return -1;
+  }
+  size_t threads = 1, batch = 1, commit_wait = 0, quorum = 0;
+  bool pipeline = false, tree = false, framed = false;
+  try {
+    for (int i = 5; i < argc; ++i){
+      string opt = argv[i];
+      bool has_arg = (i + 1 < argc);
+      if (opt == "--threads" && has_arg){
+	threads = stoul(argv[++i]);
+      } else if (opt == "--batch" && has_arg){
+	batch = stoul(argv[++i]);
+      } else if (opt == "--pipeline"){
+	pipeline = true;
+      } else if (opt == "--commit-wait" && has_arg){
+	commit_wait = stoul(argv[++i]);
+      } else if (opt == "--tree"){
+	tree = true;
+      } else if (opt == "--quorum" && has_arg){
+	string n = argv[++i];
+	quorum = (n == "majority") ? MAJORITY : stoul(n);
+      } else if (opt == "--framed"){
+	framed = true;
+      } else {
+	usage(argv[0]);
+	return -1;
+      }
+    }
+  } catch (const logic_error&) { /* stoul: not a number */
+    usage(argv[0]);
     return -1;
   }
-  Server<string> server(stoi(argv[2]));
+  Server<string> server(stoi(argv[2]), threads, batch, pipeline, commit_wait, tree, quorum, framed);
   server.run(argv[1], stoi(argv[2]), argv[3], stoi(argv[4]));
   condition_variable cv;
   mutex m;
@@ -0,0 +1,44 @@
+#include "server_2pc_AQ.h"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+using namespace std;
+
+static void usage(const char* name){
+  cerr << "Usage: " << name << " <address_of_local_machine> <port_number> <organizing_server_address> <port_number> [options]" << endl
+       << "  --commit-wait <ms>  a follower get on a dirty key waits this long for its commit (0)" << endl
+       << "  --absorb            the Leader holds stages " << ABSORB_WINDOW << " us so later writes to a key replace them" << endl;
+}
+
+int main(int argc, char ** argv){
+  if (argc < 5){
+    usage(argv[0]);
+    return -1;
+  }
+  size_t commit_wait = 0;
+  bool absorb = false;
+  try {
+    for (int i = 5; i < argc; ++i){
+      string opt = argv[i];
+      if (opt == "--commit-wait" && i + 1 < argc){
+	commit_wait = stoul(argv[++i]);
+      } else if (opt == "--absorb"){
+	absorb = true;
+      } else {
+	usage(argv[0]);
+	return -1;
+      }
+    }
+  } catch (const logic_error&) { /* stoul: not a number */
+    usage(argv[0]);
+    return -1;
+  }
+  Server<string> server(stoi(argv[2]), commit_wait, absorb);
+  server.run(argv[1], stoi(argv[2]), argv[3], stoi(argv[4]));
+  condition_variable cv;
+  mutex m;
+  unique_lock<std::mutex> lock(m);
+  cv.wait(lock, []{return false;});
+  return 0;
+}
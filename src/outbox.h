@@ -0,0 +1,151 @@
+/*********************************************************************************************
+   Description: An asynchronous outbound queue in front of one rpc::client.
+                send() only queues the message (a closure over a copy of its arguments) on
+                a RingQueue; the Outbox's own sender thread makes the rpc::client::send calls,
+                in the order they were queued. So whoever sends never waits on the socket or
+                on serialization (and can do it while holding a lock), and a slow peer only
+                backs up its own queue. send() never waits either: if the queue is full the
+                peer is too far behind to catch up, so the message is dropped and the Outbox
+                is marked failed() (and drops everything after it) for its owner to remove
+                the peer.
+                The client is not owned. Messages still queued when the Outbox is destroyed
+                are dropped.
+                An Outbox may also own a Link to the peer's replication channel; send_frame
+                queues binary frames for it on the same queue, so they keep their order
+                with the rest. A frame the Link fails to write is lost, so that marks the
+                Outbox failed() too: the peer has missed a message and must be removed.
+                A Payload is a message body msgpack encoded once; send_packed queues it
+                by reference, so fanning one out to n peers encodes it once and holds one
+                copy until the last of them has sent it. It arrives as a raw_ref argument
+                that unpack_payload decodes.
+
+ *********************************************************************************************/
+#include "rpc/client.h"
+#include "ring_queue.h"
+#include "replication_channel.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#ifndef CM_OUTBOX
+#define CM_OUTBOX
+
+#define OUTBOX_QUEUE 16384 /* Messages an Outbox holds; one more fails it (see push) */
+#define OUTBOX_IDLE 100    /* ms the sender sleeps at most while the queue is empty */
+
+typedef std::shared_ptr<const clmdep_msgpack::sbuffer> Payload;
+
+template <class V>
+Payload pack_payload(const V& v){
+  std::shared_ptr<clmdep_msgpack::sbuffer> buf = std::make_shared<clmdep_msgpack::sbuffer>();
+  clmdep_msgpack::pack(*buf, v);
+  return buf;
+}
+
+/* For passing on a body as received (the bytes raw points to only live as long as the call) */
+inline Payload copy_payload(const clmdep_msgpack::type::raw_ref& raw){
+  std::shared_ptr<clmdep_msgpack::sbuffer> buf = std::make_shared<clmdep_msgpack::sbuffer>(raw.size);
+  buf->write(raw.ptr, raw.size);
+  return buf;
+}
+
+template <class V>
+V unpack_payload(const clmdep_msgpack::type::raw_ref& raw){
+  clmdep_msgpack::object_handle handle = clmdep_msgpack::unpack(raw.ptr, raw.size);
+  return handle.get().as<V>();
+}
+
+class Outbox {
+  typedef std::function<void(rpc::client&)> Message;
+
+  rpc::client* client_;
+  Link* link_;      /* Owned, NULL: no channel */
+  RingQueue<Message> queue_;
+  QueueSignal signal_;
+  std::atomic<bool> failed_;
+  std::atomic<bool> stopping_;
+  std::thread sender_;
+
+  bool push(Message&& m){
+    if (failed_) return false;
+    if (!queue_.push(std::move(m))){
+      failed_ = true;
+      return false;
+    }
+    signal_.notify();
+    return true;
+  }
+
+  template <class... Args>
+  static void send_raw(rpc::client& client, const std::string& func, const Payload& payload, Args... args){
+    client.send(func, clmdep_msgpack::type::raw_ref(payload->data(), payload->size()), args...);
+  }
+
+  void drain(){
+    Message m;
+    size_t idle = 0;
+    while (!stopping_){
+      if (!queue_.pop(m)){
+	if (++idle < 64) std::this_thread::yield();
+	else signal_.wait_for([this](){ return stopping_ || !queue_.empty(); }, std::chrono::milliseconds(OUTBOX_IDLE));
+	continue;
+      }
+      idle = 0;
+      try {
+	m(*client_);
+      } catch (...) {
+	/* Lost like any other send to a dead peer */
+      }
+    }
+  }
+
+ public:
+  explicit Outbox(rpc::client* client, Link* link = NULL, size_t capacity = OUTBOX_QUEUE) : client_(client), link_(link), queue_(capacity), failed_(false), stopping_(false) {
+    sender_ = std::thread([this](){ this->drain(); });
+  }
+
+  ~Outbox(){
+    stopping_ = true;
+    signal_.wake();
+    sender_.join();
+    delete link_;
+  }
+
+  Outbox(const Outbox&) = delete;
+  Outbox& operator = (const Outbox&) = delete;
+
+  /* Any thread. Same as client->send(func, args...), just later; false if it was dropped */
+  template <class... Args>
+  bool send(const std::string& func, Args... args){
+    return push(std::bind(&rpc::client::send<Args...>, std::placeholders::_1, func, args...));
+  }
+
+  /* Has a message been dropped because the queue was full? */
+  bool failed() const {
+    return failed_;
+  }
+
+  bool framed() const {
+    return link_ != NULL;
+  }
+
+  /* Any thread. Sends a frame on the channel (framed() only); false if it was dropped */
+  bool send_frame(const std::string& header, const FrameBody& body = FrameBody()){
+    Link* link = link_;
+    std::atomic<bool>* failed = &failed_;
+    return push([link, failed, header, body](rpc::client&){
+	if (!link->write(header, body)) *failed = true;
+      });
+  }
+
+  /* Any thread. Sends func(payload, args...); false if it was dropped */
+  template <class... Args>
+  bool send_packed(const std::string& func, const Payload& payload, Args... args){
+    return push(std::bind(&Outbox::send_raw<Args...>, std::placeholders::_1, func, payload, args...));
+  }
+};
+
+#endif
@@ -0,0 +1,207 @@
+/*********************************************************************************************
+   Description: The staged (not yet committed) versions of one key, oldest first.
+                A ring of version numbers (capacity is always a power of 2) whose first
+                INLINE_VERSIONS slots live inside the object itself: a key with at most
+                INLINE_VERSIONS pending versions, in particular a clean key, owns no heap
+                memory. The ring only moves to the heap when it outgrows them and goes
+                back inline once it is empty again. The whole object is 24 bytes.
+                Popping the oldest version is O(1); prune_upto drops every version up to a
+                given one in a single pass.
+
+ *********************************************************************************************/
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifndef CM_PENDING_VERSIONS
+#define CM_PENDING_VERSIONS
+
+#define INLINE_VERSIONS 2 /* Must be a power of 2 */
+
+class PendingVersions {
+  union {
+    size_t inline_[INLINE_VERSIONS]; /* capacity() == INLINE_VERSIONS */
+    size_t* heap_;                   /* capacity() > INLINE_VERSIONS */
+  };
+  uint64_t start_ : 28;   /* Slot of the oldest version */
+  uint64_t size_ : 28;
+  uint64_t log_cap_ : 8;  /* capacity() == 1 << log_cap_ */
+
+  size_t capacity() const { return (size_t)1 << log_cap_; }
+  bool on_heap() const { return capacity() > INLINE_VERSIONS; }
+  size_t* slots() { return on_heap() ? heap_ : inline_; }
+  const size_t* slots() const { return on_heap() ? heap_ : inline_; }
+  size_t slot(size_t i) const { return (start_ + i) & (capacity() - 1); }
+
+  static uint16_t log2_of(size_t n){
+    uint16_t l = 0;
+    while (((size_t)1 << l) < n) ++l;
+    return l;
+  }
+
+  /* Moves the versions into a heap ring of twice the capacity */
+  void grow(){
+    size_t capacity = 2*this->capacity();
+    size_t* to = new size_t[capacity];
+    for (size_t i = 0; i < size_; ++i){
+      to[i] = (*this)[i];
+    }
+    if (on_heap()){
+      delete[] heap_;
+    }
+    heap_ = to;
+    start_ = 0;
+    log_cap_ = log2_of(capacity);
+  }
+
+  /* Back to inline storage once empty, so clean keys hold no heap memory */
+  void shrink(){
+    if (size_ == 0 && on_heap()){
+      delete[] heap_;
+      start_ = 0;
+      log_cap_ = log2_of(INLINE_VERSIONS);
+    }
+  }
+
+ public:
+  PendingVersions() : start_(0), size_(0), log_cap_(log2_of(INLINE_VERSIONS)) {}
+
+  PendingVersions(const PendingVersions& other) : start_(0), size_(other.size_), log_cap_(other.log_cap_) {
+    if (on_heap()){
+      heap_ = new size_t[capacity()];
+    }
+    for (size_t i = 0; i < size_; ++i){
+      slots()[i] = other[i];
+    }
+  }
+
+  PendingVersions(PendingVersions&& other) noexcept : start_(other.start_), size_(other.size_), log_cap_(other.log_cap_) {
+    if (other.on_heap()){
+      heap_ = other.heap_;
+    } else {
+      for (size_t i = 0; i < INLINE_VERSIONS; ++i) inline_[i] = other.inline_[i];
+    }
+    other.start_ = other.size_ = 0;
+    other.log_cap_ = log2_of(INLINE_VERSIONS);
+  }
+
+  ~PendingVersions() noexcept {
+    if (on_heap()){
+      delete[] heap_;
+    }
+  }
+
+  PendingVersions& operator = (const PendingVersions& other){
+    PendingVersions tmp(other);
+    *this = std::move(tmp);
+    return *this;
+  }
+
+  PendingVersions& operator = (PendingVersions&& other) noexcept {
+    if (this == &other) return *this;
+    if (on_heap()){
+      delete[] heap_;
+    }
+    if (other.on_heap()){
+      heap_ = other.heap_;
+    } else {
+      for (size_t i = 0; i < INLINE_VERSIONS; ++i) inline_[i] = other.inline_[i];
+    }
+    start_ = other.start_;
+    size_ = other.size_;
+    log_cap_ = other.log_cap_;
+    other.start_ = other.size_ = 0;
+    other.log_cap_ = log2_of(INLINE_VERSIONS);
+    return *this;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  /* Newest version goes at the end */
+  void insert(size_t version){
+    if (size_ == capacity()){
+      grow();
+    }
+    slots()[slot(size_)] = version;
+    ++size_;
+  }
+
+  bool contains(size_t version) const {
+    for (size_t i = 0; i < size_; ++i){
+      if ((*this)[i] == version) return true;
+    }
+    return false;
+  }
+
+  /* Undefined when empty */
+  size_t oldest() const {
+    return slots()[start_];
+  }
+
+  void pop_oldest(){
+    if (size_ == 0) return;
+    start_ = slot(1);
+    --size_;
+    shrink();
+  }
+
+  /* Removes the first occurrence of version, keeping the order of the rest.
+     Shifts whichever side of it is shorter. */
+  void remove_element(size_t version){
+    size_t index = 0;
+    for (; index < size_ && (*this)[index] != version; ++index);
+    if (index == size_) return;
+    if (index < size_ - index){
+      for (; index != 0; --index){
+	(*this)[index] = (*this)[index-1];
+      }
+      start_ = slot(1);
+    } else {
+      for (; index + 1 < size_; ++index){
+	(*this)[index] = (*this)[index+1];
+      }
+    }
+    --size_;
+    shrink();
+  }
+
+  /* Removes every version <= version (appending them to pruned) in one pass.
+     Versions are normally staged in increasing order, so this is usually just
+     a run of pop_oldest. */
+  void prune_upto(size_t version, std::vector<size_t>& pruned){
+    while (size_ != 0 && oldest() <= version){
+      pruned.push_back(oldest());
+      start_ = slot(1);
+      --size_;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < size_; ++i){
+      size_t v = (*this)[i];
+      if (v <= version){
+	pruned.push_back(v);
+      } else {
+	(*this)[kept++] = v;
+      }
+    }
+    size_ = kept;
+    shrink();
+  }
+
+  /* i-th oldest version; i < size() */
+  size_t operator[](size_t i) const {
+    return slots()[slot(i)];
+  }
+
+  size_t& operator[](size_t i) {
+    return slots()[slot(i)];
+  }
+};
+
+#endif
@@ -0,0 +1,387 @@
+/*********************************************************************************************
+   Description: A framed binary channel for replication traffic between servers, next to
+                (not instead of) rpclib.
+                A frame is a type byte, the varint length of the rest, then the fields:
+                integers are varints and byte strings are a varint length followed by the
+                bytes. There are no method names and no per-call dispatch; the receiving
+                side switches on the type byte.
+                A frame is sent as a small per-peer header plus a body that can be shared by
+                every peer it goes to (a FrameBody), in one sendmsg.
+                Link is the sending end of one connection. It connects on first use and
+                after a failure, and drops the frame it failed on (like a send to a dead peer).
+                Connecting and sending give up after CHANNEL_TIMEOUT ms, so an unreachable
+                peer never holds its sender for longer than that.
+                It is not thread safe; Outbox's sender thread is its only user.
+                FrameReader is the receiving end. It reads through a small buffer, except
+                that byte strings longer than what is buffered are received straight into
+                the destination string.
+                ChannelServer accepts connections on a port and gives each one a reader
+                thread, which hands every frame to a handler in arrival order. Readers of
+                closed connections are joined (and their sockets closed) at the next accept.
+
+ *********************************************************************************************/
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef CM_REPLICATION_CHANNEL
+#define CM_REPLICATION_CHANNEL
+
+#define CHANNEL_PORT_OFFSET 1000 /* A server's channel listens on its rpc port + this */
+#define CHANNEL_BUFFER 65536     /* Bytes a FrameReader reads ahead */
+#define CHANNEL_BACKLOG 64
+#define CHANNEL_TIMEOUT 1000     /* ms a Link waits to connect or to send */
+
+typedef std::shared_ptr<const std::string> FrameBody;
+
+inline void put_varint(std::string& out, uint64_t v){
+  while (v >= 0x80){
+    out.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+inline void put_bytes(std::string& out, const char* data, size_t size){
+  put_varint(out, size);
+  out.append(data, size);
+}
+
+inline void put_bytes(std::string& out, const std::string& bytes){
+  put_bytes(out, bytes.data(), bytes.size());
+}
+
+/* Starts a frame of type whose fields after header are body_size bytes long */
+inline std::string frame_header(uint8_t type, const std::string& header, size_t body_size){
+  std::string out;
+  out.reserve(header.size() + 12);
+  out.push_back((char)type);
+  put_varint(out, header.size() + body_size);
+  out.append(header);
+  return out;
+}
+
+class FrameReader {
+  int fd_;
+  char buf_[CHANNEL_BUFFER];
+  size_t pos_;
+  size_t end_;
+  size_t left_;   /* Unread bytes of the current frame */
+  bool failed_;
+
+  bool fill(){
+    if (failed_) return false;
+    ssize_t got = ::recv(fd_, buf_, CHANNEL_BUFFER, 0);
+    if (got <= 0){
+      failed_ = true;
+      return false;
+    }
+    pos_ = 0;
+    end_ = got;
+    return true;
+  }
+
+  bool byte(uint8_t& b){
+    if (pos_ == end_ && !fill()) return false;
+    b = (uint8_t)buf_[pos_++];
+    return true;
+  }
+
+  bool raw_varint(uint64_t& v){
+    v = 0;
+    uint8_t b;
+    for (size_t shift = 0; shift < 64; shift += 7){
+      if (!byte(b)) return false;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) return true;
+    }
+    failed_ = true;
+    return false;
+  }
+
+  /* Reads n bytes into dst (buffered ones first, the rest straight from the socket) */
+  bool read(char* dst, size_t n){
+    size_t have = std::min(n, end_ - pos_);
+    std::memcpy(dst, buf_ + pos_, have);
+    pos_ += have;
+    for (size_t done = have; done < n; ){
+      if (n - done < CHANNEL_BUFFER){ /* Small rest: refill instead */
+	if (!fill()) return false;
+	size_t take = std::min(n - done, end_);
+	std::memcpy(dst + done, buf_, take);
+	pos_ = take;
+	done += take;
+	continue;
+      }
+      ssize_t got = ::recv(fd_, dst + done, n - done, 0);
+      if (got <= 0){
+	failed_ = true;
+	return false;
+      }
+      done += got;
+    }
+    return true;
+  }
+
+ public:
+  explicit FrameReader(int fd) : fd_(fd), pos_(0), end_(0), left_(0), failed_(false) {}
+
+  /* Skips whatever is left of the current frame and starts the next */
+  bool next(uint8_t& type){
+    while (left_ != 0 && !failed_){
+      if (pos_ == end_ && !fill()) break;
+      size_t skip = std::min(left_, end_ - pos_);
+      pos_ += skip;
+      left_ -= skip;
+    }
+    uint64_t size;
+    if (!byte(type) || !raw_varint(size)) return false;
+    left_ = size;
+    return true;
+  }
+
+  uint64_t varint(){
+    uint64_t v = 0;
+    uint8_t b;
+    for (size_t shift = 0; shift < 64 && left_ != 0; shift += 7){
+      if (!byte(b)) return 0;
+      --left_;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) return v;
+    }
+    failed_ = true;
+    return 0;
+  }
+
+  bool bytes(std::string& dst){
+    uint64_t size = varint();
+    if (failed_ || size > left_){
+      failed_ = true;
+      return false;
+    }
+    dst.resize(size);
+    if (size != 0 && !read(&dst[0], size)) return false;
+    left_ -= size;
+    return true;
+  }
+
+  /* Unread bytes of the current frame: a bound on how many fields are left */
+  size_t remaining() const {
+    return left_;
+  }
+
+  /* Did the connection fail or a frame not match its fields? */
+  bool failed() const {
+    return failed_;
+  }
+};
+
+class Link {
+  std::string addr_;
+  size_t port_;
+  int fd_;
+
+  /* Connects fd to addr, giving up after CHANNEL_TIMEOUT ms */
+  static bool timed_connect(int fd, const struct sockaddr* addr, socklen_t len){
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) return false;
+    if (::connect(fd, addr, len) != 0){
+      if (errno != EINPROGRESS) return false;
+      struct pollfd p;
+      p.fd = fd;
+      p.events = POLLOUT;
+      p.revents = 0;
+      if (::poll(&p, 1, CHANNEL_TIMEOUT) != 1) return false;
+      int error = 0;
+      socklen_t size = sizeof(error);
+      if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0 || error != 0) return false;
+    }
+    return ::fcntl(fd, F_SETFL, flags) == 0;
+  }
+
+  bool connect(){
+    struct addrinfo hints, *found = NULL;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (::getaddrinfo(addr_.c_str(), std::to_string(port_).c_str(), &hints, &found) != 0){
+      return false;
+    }
+    for (struct addrinfo* a = found; a != NULL && fd_ < 0; a = a->ai_next){
+      fd_ = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd_ < 0) continue;
+      if (!timed_connect(fd_, a->ai_addr, a->ai_addrlen)){
+	::close(fd_);
+	fd_ = -1;
+      }
+    }
+    ::freeaddrinfo(found);
+    if (fd_ < 0) return false;
+    int on = 1;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct timeval timeout;
+    timeout.tv_sec = CHANNEL_TIMEOUT / 1000;
+    timeout.tv_usec = (CHANNEL_TIMEOUT % 1000) * 1000;
+    ::setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); /* sendmsg fails instead of blocking */
+    return true;
+  }
+
+ public:
+  Link(const std::string& addr, size_t port) : addr_(addr), port_(port), fd_(-1) {}
+
+  ~Link(){
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  Link(const Link&) = delete;
+  Link& operator = (const Link&) = delete;
+
+  /* Writes header then body (NULL for none). False if the frame was lost. */
+  bool write(const std::string& header, const FrameBody& body){
+    if (fd_ < 0 && !connect()) return false;
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char*>(header.data());
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = body ? const_cast<char*>(body->data()) : NULL;
+    iov[1].iov_len = body ? body->size() : 0;
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (iov[0].iov_len + iov[1].iov_len != 0){
+      ssize_t sent = ::sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      if (sent < 0){
+	::close(fd_);
+	fd_ = -1;
+	return false;
+      }
+      for (size_t i = 0; i < 2; ++i){ /* Skip what went out */
+	size_t done = std::min((size_t)sent, iov[i].iov_len);
+	iov[i].iov_base = (char*)iov[i].iov_base + done;
+	iov[i].iov_len -= done;
+	sent -= done;
+      }
+    }
+    return true;
+  }
+};
+
+class ChannelServer {
+ public:
+  typedef std::function<void(uint8_t, FrameReader&)> Handler;
+
+ private:
+  Handler handler_;
+  int listen_fd_;
+  std::atomic<bool> stopping_;
+  std::thread acceptor_;
+  std::vector<std::thread> readers_;
+  std::vector<int> fds_;        /* fds_[i] is read by readers_[i] */
+  std::vector<int> finished_;   /* fds whose reader has returned */
+  std::mutex readers_mutex_;
+
+  void serve(int fd){
+    FrameReader in(fd);
+    uint8_t type;
+    while (!stopping_ && in.next(type)){
+      handler_(type, in);
+      if (in.failed()) break;
+    }
+    std::unique_lock<std::mutex> lock(readers_mutex_);
+    finished_.push_back(fd);
+  }
+
+  /* Joins the readers that returned and closes their fds.
+     Assumes thread already has control of readers_mutex_ */
+  void reap(){
+    for (size_t f = 0; f < finished_.size(); ++f){
+      for (size_t i = 0; i < fds_.size(); ++i){
+	if (fds_[i] != finished_[f]) continue;
+	readers_[i].join();  /* It only has to return */
+	::close(fds_[i]);
+	readers_.erase(readers_.begin() + i);
+	fds_.erase(fds_.begin() + i);
+	break;
+      }
+    }
+    finished_.clear();
+  }
+
+  void accept_all(){
+    while (!stopping_){
+      int fd = ::accept(listen_fd_, NULL, NULL);
+      if (fd < 0) continue;
+      int on = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      std::unique_lock<std::mutex> lock(readers_mutex_);
+      if (stopping_){
+	::close(fd);
+	break;
+      }
+      reap();
+      fds_.push_back(fd);
+      readers_.push_back(std::thread([this, fd](){ this->serve(fd); }));
+    }
+  }
+
+ public:
+  /* Throws std::runtime_error if port can't be listened on */
+  ChannelServer(size_t port, Handler handler) : handler_(handler), listen_fd_(-1), stopping_(false) {
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (listen_fd_ < 0 || ::bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listen_fd_, CHANNEL_BACKLOG) != 0){
+      if (listen_fd_ >= 0) ::close(listen_fd_);
+      throw std::runtime_error("replication channel: can't listen on port " + std::to_string(port));
+    }
+    acceptor_ = std::thread([this](){ this->accept_all(); });
+  }
+
+  ~ChannelServer(){
+    stopping_ = true;
+    ::shutdown(listen_fd_, SHUT_RDWR);
+    ::close(listen_fd_);
+    acceptor_.join();
+    std::unique_lock<std::mutex> lock(readers_mutex_);
+    for (size_t i = 0; i < fds_.size(); ++i){
+      ::shutdown(fds_[i], SHUT_RDWR);
+    }
+    lock.unlock();  /* Returning readers take it */
+    for (size_t i = 0; i < readers_.size(); ++i){
+      readers_[i].join();
+    }
+    for (size_t i = 0; i < fds_.size(); ++i){
+      ::close(fds_[i]);
+    }
+  }
+
+  ChannelServer(const ChannelServer&) = delete;
+  ChannelServer& operator = (const ChannelServer&) = delete;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*********************************************************************************************
+   Description: A bounded lock free queue for many producers and one consumer (MPSC, and
+                so also SPSC).
+                Like CircularBuffer the capacity is a power of 2 and positions are mapped to
+                slots with a mask, but positions only ever grow: producers claim a tail
+                position with a CAS, the consumer owns the head. Every slot carries a
+                sequence number telling whose turn it is (the producer of position p waits
+                for p, the consumer of p waits for p+1), so no slot is ever read half written.
+                head and tail live on their own cache lines so producers and the consumer
+                don't false share.
+                Slots are raw storage; only queued items are constructed.
+                QueueSignal lets the consumer sleep while the queue is empty instead of
+                polling it. Producers call notify() after a push: a fence and a load, plus a
+                lock and a notify only when the consumer is actually asleep.
+
+ *********************************************************************************************/
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifndef CM_RING_QUEUE
+#define CM_RING_QUEUE
+
+#define CACHE_LINE 64
+
+template <class T>
+class RingQueue {
+  struct slot_t{
+    std::atomic<size_t> seq;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type item;
+  };
+
+  slot_t* slots_;
+  size_t mask_;   /* capacity - 1 */
+  char pad0_[CACHE_LINE - sizeof(slot_t*) - sizeof(size_t)];
+  std::atomic<size_t> tail_;  /* Next position to push (producers) */
+  char pad1_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> head_;  /* Next position to pop (consumer only) */
+  char pad2_[CACHE_LINE - sizeof(std::atomic<size_t>)];
+
+  static size_t next_pow2(size_t n){
+    size_t size = 1;
+    while (size < n){
+      size *= 2;
+    }
+    return size;
+  }
+
+  T* item_at(slot_t& slot){
+    return reinterpret_cast<T*>(&slot.item);
+  }
+
+ public:
+  /* Holds at least capacity items */
+  explicit RingQueue(size_t capacity) : mask_(next_pow2(capacity) - 1), tail_(0), head_(0) {
+    slots_ = static_cast<slot_t*>(::operator new((mask_ + 1) * sizeof(slot_t)));
+    for (size_t i = 0; i <= mask_; ++i){
+      new (&slots_[i].seq) std::atomic<size_t>(i);
+    }
+  }
+
+  ~RingQueue(){
+    for (size_t pos = head_.load(); slots_[pos & mask_].seq.load() == pos + 1; ++pos){
+      item_at(slots_[pos & mask_])->~T();
+    }
+    ::operator delete(slots_);
+  }
+
+  RingQueue(const RingQueue&) = delete;
+  RingQueue& operator = (const RingQueue&) = delete;
+
+  /* Any thread. Returns false if the queue is full; item is only moved from on success. */
+  bool push(T&& item){
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    slot_t* slot;
+    for (;;){
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0){
+	if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+	  break;
+	}
+      } else if (diff < 0){
+	return false; /* the consumer hasn't freed this slot yet */
+      } else {
+	pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    new (item_at(*slot)) T(std::move(item));
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool push(const T& item){
+    T copy(item);
+    return push(std::move(copy));
+  }
+
+  /* Consumer thread only. Returns false if the queue is empty. */
+  bool pop(T& item){
+    size_t pos = head_.load(std::memory_order_relaxed);
+    slot_t& slot = slots_[pos & mask_];
+    if (slot.seq.load(std::memory_order_acquire) != pos + 1){
+      return false;
+    }
+    T* queued = item_at(slot);
+    item = std::move(*queued);
+    queued->~T();
+    slot.seq.store(pos + mask_ + 1, std::memory_order_release); /* free for position pos + capacity */
+    head_.store(pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /* Approximate unless called by the consumer with producers stopped */
+  bool empty() const {
+    return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_relaxed);
+  }
+
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+};
+
+class QueueSignal {
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> sleeping_;
+
+ public:
+  QueueSignal() : sleeping_(false) {}
+
+  QueueSignal(const QueueSignal&) = delete;
+  QueueSignal& operator = (const QueueSignal&) = delete;
+
+  /* Producers, after a successful push */
+  void notify(){
+    std::atomic_thread_fence(std::memory_order_seq_cst); /* Pairs with the fence in wait_for */
+    if (sleeping_.load(std::memory_order_relaxed)){
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
+  }
+
+  /* Wakes the consumer whatever it waits for (e.g. to stop) */
+  void wake(){
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_one();
+  }
+
+  /* Consumer: sleeps until ready() (e.g. the queue is not empty) or timeout */
+  template <class Pred, class Duration>
+  void wait_for(Pred ready, Duration timeout){
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    cv_.wait_for(lock, timeout, ready);
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+};
+
+#endif
@@ -11,29 +11,88 @@
 #include "rpc/server.h"
 #include "rpc/client.h"
 #include "key_value.h"
+#include "concurrent_key_value.h"
 #include "hash_table.h"
-#include "circular_buffer.h"
+#include "flat_hash_table.h"
+#include "pending_versions.h"
+#include "ring_queue.h"
+#include "outbox.h"
+#include "shared_value.h"
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <exception>
 #include <future>
+#include <functional>
+#include <queue>
 #include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <atomic>
+#include <set>
+#include <thread>
+#include <tuple>
 
 #ifndef CM_SERVER_2PC
 #define CM_SERVER_2PC
 
 #define PUT 0
 #define REMOVE 1
-#define DONE 2
+#define DONE 2        /* Only used by join: stages a committed value */
+#define ACKNOWLEDGE 3 /* Only used for events_ */
+#define MULTI 4       /* Only used for events_ */
+#define TXN 5         /* Only used for events_ */
 
 #define ALIVE_TIME 5000 /* A commit may take upto max(ALIVE_TIME, others_[i]->get_timeout()) ms */
+#define EVENT_QUEUE 65536 /* Writes/acks the Leader's RPC threads may queue for the replication thread */
+#define BATCH_WINDOW 200  /* Group commit: us the Leader waits to fill a batch after its first write */
+#define REPLICATE_IDLE 1  /* ms the replication thread sleeps at most with nothing to do (it still publishes and releases) */
+#define NO_WATERMARK ((size_t)-1) /* Sent where a message carries no watermark */
+#define COMMIT_STRIPES 64 /* Condition variables that waiting gets share (by key hash) */
+#define NO_SLOT ((size_t)-1)      /* Acknowledgements nobody waits for (tree mode joins) */
+#define TREE_CONNECT_TIME 1000    /* ms a follower waits to connect to its parent or a child */
+#define MAJORITY ((size_t)-1)     /* Quorum: enough followers for a majority with the Leader */
+#define LEASE_TIME 40     /* ms a follower may answer gets itself per lease from the Leader */
+
+/* Frame types on the replication channel (framed mode, see on_frame) */
+#define FRAME_STAGE 1       /* index watermark | query action key val */
+#define FRAME_STAGE_BATCH 2 /* index watermark | n, n x (query action key val) */
+#define FRAME_STAGE_TXN 3   /* index watermark | n, n x (query action key val) */
+#define FRAME_ACKNOWLEDGE 4 /* first, last - first, index */
+#define FRAME_COMMIT 5      /* n, n x query */
+#define FRAME_COMMIT_UPTO 6 /* watermark */
+#define FRAME_ALIVE 7       /* index, watermark */
+
+/* How a value goes on the replication channel: a std::string as its bytes, anything else
+   as its msgpack encoding */
+template <class T>
+struct WireValue {
+  static void put(std::string& out, const T& val){
+    clmdep_msgpack::sbuffer buf;
+    clmdep_msgpack::pack(buf, val);
+    put_bytes(out, buf.data(), buf.size());
+  }
+  static bool get(FrameReader& in, T& val){
+    std::string bytes;
+    if (!in.bytes(bytes)) return false;
+    clmdep_msgpack::object_handle handle = clmdep_msgpack::unpack(bytes.data(), bytes.size());
+    val = handle.get().template as<T>();
+    return true;
+  }
+};
+
+template <>
+struct WireValue<std::string> {
+  static void put(std::string& out, const std::string& val){ put_bytes(out, val); }
+  static bool get(FrameReader& in, std::string& val){ return in.bytes(val); }
+};
 
 template <class T>
 class Server {
   rpc::server* self_;                                    /* self */
   std::vector<rpc::client*> others_;                     /* others[0] == Leader */
+  std::vector<Outbox*> outboxes_;                        /* outboxes_[i] sends to others_[i]: every send goes through one */
   std::vector<std::pair<std::string, size_t>> others_id_;/* Only used by Leader */
   std::vector<bool> alive_;                              /* Did node i respond back in time? */
   bool leader_;                                          /* Am I the Leader? */
@@ -41,29 +100,37 @@ class Server {
   std::atomic<bool> pulse_;                              /* Has the Leader contacted me recently? */
 
 
-  /* The type of versions */
+  /* The type of versions: the committed value is kept inline, so a clean key is
+     read with one probe of kv_ (only staged queries are in queries_) */
   struct versions_t{
     versions_t () : current(0), valid(false) {}
-    versions_t (size_t v) : current(v), valid(true) {}
-    size_t current;
-    bool valid;
-    CircularBuffer<size_t> versions;
+    size_t current;               /* Query that wrote value */
+    bool valid;                   /* false: no committed value (never written or removed) */
+    SharedValue<T> value;         /* Shared with the query that wrote it */
+    PendingVersions versions;     /* Staged, not yet committed versions; a clean key holds no heap memory */
   };
   
-  KeyValueStore<std::string, versions_t> kv_;                     /* self's key value storage */
+  /* Dirty follower gets probe both tables, so both are open addressing. kv_ is read
+     by get/version without queries_mutex_, so it is sharded and locked itself. */
+  typedef ConcurrentKeyValueStore<std::string, versions_t, FlatHashTable<std::string, versions_t>> KVStore;
+  KVStore kv_;                                           /* self's key value storage */
 
   typedef char Action;
   typedef std::chrono::steady_clock::time_point TIME_STAMP;
   
   struct Query{
-    Query() {}
-    Query(const std::string& k, const T& val, Action act, TIME_STAMP now, size_t a = 0) : key(k), val(val), action(act), time(now), acks(a) { who.resize(a, false); }
+    Query() : span(1) {}
+    /* who has room for max(a, n) followers (quorum mode waits for fewer than it sends to) */
+    Query(const std::string& k, size_t h, const SharedValue<T>& val, Action act, TIME_STAMP now, size_t a = 0, size_t n = 0) : key(k), hash(h), val(val), action(act), time(now), acks(a), span(1) { who.resize(std::max(a, n), false); }
     std::string key;
-    T val;
+    size_t hash;           /* KeyHash of key, computed once in stage */
+    SharedValue<T> val;    /* Shared with kv_ readers and get responses, never copied */
     Action action;
     std::vector<bool> who;
     TIME_STAMP time;
     size_t acks;           /* If acks == 0 then ready to commit */
+    size_t span;           /* A transaction is queries [query, query + span), acknowledged and
+			      committed through the first; the others have span 0 */
   };
 
   struct time_info{
@@ -77,87 +144,972 @@ class Server {
   std::vector<time_info> times_;
 
   /* The set of inprogress commits */
-  HashTable<size_t, Query> queries_;
-  size_t next_query_;
+  typedef FlatHashTable<size_t, Query> QueryTable;
+  QueryTable queries_;
+  std::atomic<size_t> next_query_;
 
   /* Locks for multi-thread access to the respective containers */
   std::mutex alive_mutex_;
   std::mutex others_mutex_;
   std::mutex queries_mutex_;
   std::mutex times_mutex_;
+
+  size_t threads_;                                       /* RPC worker threads (kv_ is safe to share) */
+  size_t batch_;                                         /* Leader: max writes per stage_batch (1 == one stage per write) */
+
+  /* The Leader streams a commit watermark (every query below it is committed): it rides
+     on stage, stage_batch and alive, and goes out as commit_upto when nothing else is
+     being sent. Followers commit their staged queries below it themselves and answer
+     gets on dirty keys from it. In pipelined mode the Leader sends no commit messages. */
+  typedef std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>> MinQueries;
+  bool pipeline_;
+  std::atomic<size_t> committed_;                        /* Leader: every query < committed_ is committed; Follower: latest watermark */
+  MinQueries done_;                                      /* Leader: committed queries >= committed_ */
+  std::atomic<size_t> published_;                        /* Leader: last watermark sent (written under others_mutex_) */
+  MinQueries staged_;                                    /* Follower: staged queries waiting for the watermark */
+
+  /* One staged write of a stage_batch: (key, val, action, query) */
+  typedef std::tuple<std::string, T, Action, size_t> Staged;
+
+  /* Leader only: RPC threads push put/remove/acknowledge events and a single
+     replication thread applies them, so RPC threads never queue on queries_mutex_ */
+  struct Event{
+    Event() {}
+    Event(Action k, const std::string& key, const T& val, size_t q = 0, size_t i = 0) : kind(k), key(key), val(val), query(q), index(i), last(q) {}
+    Action kind;
+    std::string key;
+    T val;
+    size_t query;
+    size_t index;
+    size_t last;   /* ACKNOWLEDGE: acknowledges queries [query, last] */
+    std::vector<Staged> writes; /* MULTI / TXN: the writes of one mput, mremove or txn */
+  };
+
+  /* Tree mode: followers form a binary tree under the Leader (follower i's children are
+     followers 2i+2 and 2i+3, the Leader's are 0 and 1). Stage and commit messages go down
+     the tree, every node relaying them to its children, and a node acknowledges to its
+     parent once its whole subtree has staged, so no node sends to more than 2 others.
+     A follower's acks/who count its children (who is indexed by slot: 0 left, 1 right).
+     Heartbeats and joins still go directly between the Leader and every follower. */
+  bool tree_;
+  rpc::client* parent_;                                  /* Follower: NULL when the parent is the Leader */
+  rpc::client* left_;                                    /* Follower: children, NULL if none */
+  rpc::client* right_;
+  Outbox* parent_out_;                                   /* Follower: send to parent_, left_, right_ */
+  Outbox* left_out_;
+  Outbox* right_out_;
+  std::vector<std::pair<std::string, size_t>> family_;   /* Follower: addresses of parent_, left_, right_ */
+  size_t slot_;                                          /* Follower: which child of its parent it is */
+
+  /* Quorum mode: the Leader commits a query once quorum_ followers have acknowledged it
+     and sends the rest its commit as their acknowledgements come in. A follower only
+     answers gets itself while it holds a lease, and the Leader leases only to followers
+     that have every query committed without them; a query can't commit without a
+     follower whose lease hasn't run out (it waits in held_), so a follower with a lease
+     has staged every committed query. Every node takes the same quorum; not used in tree mode. */
+  size_t quorum_;                                        /* 0: every follower */
+  std::vector<std::set<size_t>> lagging_;                /* Leader: per follower, queries that got their quorum without it */
+  std::vector<TIME_STAMP> leases_;                       /* Leader: per follower, when its lease runs out */
+  std::vector<size_t> held_;                             /* Leader: queries with a quorum waiting on leases (under queries_mutex_) */
+  std::atomic<bool> holding_;                            /* Leader: !held_.empty() */
+  std::atomic<long long> lease_;                         /* Follower: steady_clock ticks its lease runs out at */
+  std::thread leaser_;                                   /* Follower: renews lease_ */
+
+  /* Commit-wait reads: a follower get on a dirty key first waits up to commit_wait_ ms
+     for the newest version it has staged to commit, and only then asks the Leader */
+  size_t commit_wait_;                                   /* 0: ask the Leader right away */
+  std::condition_variable commit_cv_[COMMIT_STRIPES];    /* Notified (under queries_mutex_) by commits to keys hashing there */
+
+  /* Follower: version lookups waiting for the next versions call to the Leader */
+  typedef std::pair<bool, size_t> Version;               /* (valid, current) */
+  typedef FlatHashTable<std::string, std::shared_future<Version>> LookupTable;
+  LookupTable lookups_;                                  /* Waiting key -> its answer */
+  std::vector<std::string> waiting_keys_;
+  std::vector<std::promise<Version>> waiting_;
+  bool sending_;                                         /* Is some get sending a batch? */
+  std::mutex lookups_mutex_;
+
+  /* Framed mode: stage, acknowledge, commit, commit_upto and alive between servers go as
+     binary frames on a replication channel (rpc port + CHANNEL_PORT_OFFSET); clients,
+     joins and lookups stay on rpclib. Every node takes the same setting. */
+  bool framed_;
+  ChannelServer* channel_;
+
+  RingQueue<Event> events_;
+  QueueSignal events_signal_;
+  std::thread replicator_;
+  std::atomic<bool> stopping_;
   
   void register_funcs(){
     self_->bind("get", [this](std::string key){ return this->get(key); });
     self_->bind("put", [this](std::string key, T val){ this->put(key, val); });
     self_->bind("remove", [this](std::string key){ this->remove(key); });
-    self_->bind("acknowledge", [this](size_t query, size_t index){ this->acknowledge(query, index); });
+    self_->bind("mget", [this](std::vector<std::string> keys){ return this->mget(keys); });
+    self_->bind("mput", [this](std::vector<std::pair<std::string, T>> pairs){ this->mput(pairs); });
+    self_->bind("mremove", [this](std::vector<std::string> keys){ this->mremove(keys); });
+    self_->bind("txn", [this](std::vector<std::pair<std::string, T>> puts, std::vector<std::string> removes){ this->txn(puts, removes); });
+    self_->bind("acknowledge", [this](size_t query, size_t index){ this->acknowledged(query, query, index); });
     self_->bind("join", [this](std::string address, size_t port = 8080){ this->join(address, port); });
-    self_->bind("stage", [this](std::string key, T val, Action act, size_t query, size_t index){ this->stage(key, val, act, query, index); });
-    self_->bind("commit", [this](size_t query){ this->commit(query); });
+    self_->bind("acknowledge_batch", [this](size_t first, size_t last, size_t index){ this->acknowledged(first, last, index); });
+    self_->bind("stage", [this](std::string key, T val, Action act, size_t query, size_t index, size_t watermark){ this->stage(key, val, act, query, index, watermark); });
+    self_->bind("stage_batch", [this](std::vector<Staged> batch, size_t index, size_t watermark){ this->stage_batch(batch, index, watermark); });
+    self_->bind("stage_txn", [this](std::vector<Staged> writes, size_t index, size_t watermark){ this->stage_txn(writes, index, watermark); });
+    /* Fan-out: the writes arrive encoded once for every follower (see fan_out) */
+    self_->bind("stage_packed", [this](clmdep_msgpack::type::raw_ref packed, size_t index, size_t watermark){
+	Staged s = unpack_payload<Staged>(packed);
+	this->stage(std::get<0>(s), std::get<1>(s), std::get<2>(s), std::get<3>(s), index, watermark, &packed);
+      });
+    self_->bind("stage_batch_packed", [this](clmdep_msgpack::type::raw_ref packed, size_t index, size_t watermark){
+	this->stage_batch(unpack_payload<std::vector<Staged>>(packed), index, watermark, &packed);
+      });
+    self_->bind("stage_txn_packed", [this](clmdep_msgpack::type::raw_ref packed, size_t index, size_t watermark){
+	std::vector<Staged> writes = unpack_payload<std::vector<Staged>>(packed);
+	this->stage_txn(writes, index, watermark, &packed);
+      });
+    self_->bind("commit", [this](size_t query){ this->committed(std::vector<size_t>(1, query)); });
+    self_->bind("commit_batch", [this](std::vector<size_t> queries){ this->committed(queries); });
+    self_->bind("commit_upto", [this](size_t watermark){ this->committed_upto(watermark); });
+    self_->bind("tree", [this](std::pair<std::string, size_t> parent, std::vector<std::pair<std::string, size_t>> children, size_t slot){
+	this->plant(parent, children, slot);
+      });
     self_->bind("ready", [this](){ this->ready_ = true; });
     /* Testing aliveness */
-    self_->bind("alive", [this](size_t index){ this->alive(index); });
+    self_->bind("alive", [this](size_t index, size_t watermark){ this->alive(index, watermark); });
     self_->bind("check", [this](std::string addr, size_t port){ return this->check(addr, port); });
+    self_->bind("lease", [this](std::string addr, size_t port){ return this->lease(addr, port); });
     self_->bind("ping", [](){});
     self_->bind("version", [this](std::string key){ return this->version(key); });
+    self_->bind("versions", [this](std::vector<std::string> keys){ return this->versions(keys); });
   }
 
-  std::pair<bool, size_t> version(const std::string& key){
-    typename KeyValueStore<std::string, versions_t>::find_t found = kv_.find(key);
-    versions_t vers = versions_t();
-    if (found.found){
-      vers = found.value;
+  /* Either transport: acknowledgements of [first, last] (the Leader queues them for the
+     replication thread) */
+  void acknowledged(size_t first, size_t last, size_t index){
+    if (leader_){
+      Event e(ACKNOWLEDGE, std::string(), T(), first, index);
+      e.last = last;
+      enqueue(std::move(e));
+    } else if (first == last){
+      acknowledge(first, index);
+    } else {
+      acknowledge_batch(first, last, index);
+    }
+  }
+
+  /* Follower, either transport: commits queries, then passes them on to its children */
+  void committed(const std::vector<size_t>& queries){
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    for (size_t i = 0; i < queries.size(); ++i){
+      commit_local(queries[i]);
+    }
+    for (size_t i = 0; i < fanout(); ++i){
+      send_commit(downstream(i), queries);
+    }
+  }
+
+  void committed_upto(size_t watermark){
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    commit_upto(watermark);
+    for (size_t i = 0; i < fanout(); ++i){
+      send_commit_upto(downstream(i), watermark);
+    }
+  }
+
+  /* The messages framed mode carries, on whichever transport out uses */
+  void send_acknowledge(Outbox* out, size_t first, size_t last, size_t index){
+    if (!out->framed()){
+      if (first == last) out->send("acknowledge", first, index);
+      else out->send("acknowledge_batch", first, last, index);
+      return;
+    }
+    std::string fields;
+    put_varint(fields, first);
+    put_varint(fields, last - first);
+    put_varint(fields, index);
+    out->send_frame(frame_header(FRAME_ACKNOWLEDGE, fields, 0));
+  }
+
+  void send_commit(Outbox* out, const std::vector<size_t>& queries){
+    if (!out->framed()){
+      if (queries.size() == 1) out->send("commit", queries[0]);
+      else out->send("commit_batch", queries);
+      return;
+    }
+    std::string fields;
+    put_varint(fields, queries.size());
+    for (size_t i = 0; i < queries.size(); ++i){
+      put_varint(fields, queries[i]);
+    }
+    out->send_frame(frame_header(FRAME_COMMIT, fields, 0));
+  }
+
+  void send_commit(Outbox* out, size_t query){
+    send_commit(out, std::vector<size_t>(1, query));
+  }
+
+  void send_commit_upto(Outbox* out, size_t watermark){
+    if (!out->framed()){
+      out->send("commit_upto", watermark);
+      return;
+    }
+    std::string fields;
+    put_varint(fields, watermark);
+    out->send_frame(frame_header(FRAME_COMMIT_UPTO, fields, 0));
+  }
+
+  void send_alive(Outbox* out, size_t index, size_t watermark){
+    if (!out->framed()){
+      out->send("alive", index, watermark);
+      return;
+    }
+    std::string fields;
+    put_varint(fields, index);
+    put_varint(fields, watermark);
+    out->send_frame(frame_header(FRAME_ALIVE, fields, 0));
+  }
+
+  static void put_write(std::string& out, const Staged& w){
+    put_varint(out, std::get<3>(w));
+    put_varint(out, (uint8_t)std::get<2>(w));
+    put_bytes(out, std::get<0>(w));
+    WireValue<T>::put(out, std::get<1>(w));
+  }
+
+  static void put_writes(std::string& out, const Staged& w){
+    put_write(out, w);
+  }
+
+  static void put_writes(std::string& out, const std::vector<Staged>& writes){
+    put_varint(out, writes.size());
+    for (size_t i = 0; i < writes.size(); ++i){
+      put_write(out, writes[i]);
+    }
+  }
+
+  /* Keys and values are read straight into w */
+  static bool get_write(FrameReader& in, Staged& w){
+    std::get<3>(w) = in.varint();
+    std::get<2>(w) = (Action)in.varint();
+    return in.bytes(std::get<0>(w)) && WireValue<T>::get(in, std::get<1>(w));
+  }
+
+  static bool get_writes(FrameReader& in, std::vector<Staged>& writes){
+    size_t n = in.varint();
+    if (in.failed() || n > in.remaining()) return false; /* Every write takes at least a byte */
+    writes.resize(n);
+    for (size_t i = 0; i < writes.size(); ++i){
+      if (!get_write(in, writes[i])) return false;
+    }
+    return !in.failed();
+  }
+
+  /* Framed mode: one frame from the replication channel (frames from one peer arrive in order) */
+  void on_frame(uint8_t type, FrameReader& in){
+    switch (type){
+      case FRAME_STAGE:
+      case FRAME_STAGE_BATCH:
+      case FRAME_STAGE_TXN: {
+	size_t index = in.varint();
+	size_t watermark = in.varint();
+	std::vector<Staged> writes(1);
+	if (type == FRAME_STAGE ? !get_write(in, writes[0]) : !get_writes(in, writes)) return;
+	if (type == FRAME_STAGE){
+	  stage(std::get<0>(writes[0]), std::get<1>(writes[0]), std::get<2>(writes[0]), std::get<3>(writes[0]), index, watermark);
+	} else if (type == FRAME_STAGE_BATCH){
+	  stage_batch(writes, index, watermark);
+	} else {
+	  stage_txn(writes, index, watermark);
+	}
+	break;
+      }
+      case FRAME_ACKNOWLEDGE: {
+	size_t first = in.varint();
+	size_t last = first + in.varint();
+	size_t index = in.varint();
+	if (!in.failed()) acknowledged(first, last, index);
+	break;
+      }
+      case FRAME_COMMIT: {
+	size_t n = in.varint();
+	if (in.failed() || n > in.remaining()) break; /* Every query takes at least a byte */
+	std::vector<size_t> queries(n);
+	for (size_t i = 0; i < queries.size() && !in.failed(); ++i){
+	  queries[i] = in.varint();
+	}
+	if (!in.failed()) committed(queries);
+	break;
+      }
+      case FRAME_COMMIT_UPTO: {
+	size_t watermark = in.varint();
+	if (!in.failed()) committed_upto(watermark);
+	break;
+      }
+      case FRAME_ALIVE: {
+	size_t index = in.varint();
+	size_t watermark = in.varint();
+	if (!in.failed()) alive(index, watermark);
+	break;
+      }
+    }
+  }
+
+  /* An Outbox for others_[i] / parent_ / left_ / right_ at (addr, port) */
+  Outbox* outbox_to(rpc::client* client, const std::string& addr, size_t port){
+    return new Outbox(client, framed_ ? new Link(addr, port + CHANNEL_PORT_OFFSET) : NULL);
+  }
+
+  std::vector<Version> versions(const std::vector<std::string>& keys){
+    std::vector<Version> found;
+    found.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i){
+      found.push_back(version(keys[i]));
     }
-    return std::make_pair(vers.valid, vers.current);
+    return found;
   }
 
-  T get(const std::string& key){
-    typename KeyValueStore<std::string, versions_t>::find_t found = kv_.find(key);
-    versions_t vers = versions_t();
+  /* Follower: asks the Leader for the committed version of key. Lookups coalesce: gets
+     of a key that is already waiting share its answer, and whichever get finds no batch
+     in flight sends every waiting key as one versions call (and keeps sending until
+     none are left). A lookup only joins a batch that hasn't been sent yet, so its
+     answer is never older than the get. */
+  Version lookup_version(const HashedKey<std::string>& hkey){
+    std::unique_lock<std::mutex> llock(lookups_mutex_);
+    typename LookupTable::find_t found = lookups_.find(hkey);
     if (found.found){
-      vers = found.value;
+      llock.unlock();
+      return found.value.get();
     }
-    if (leader_ || vers.versions.size() <= 1){
-      if (vers.valid){
-	return queries_[vers.current].val;
+    waiting_.push_back(std::promise<Version>());
+    std::shared_future<Version> answer = waiting_.back().get_future().share();
+    waiting_keys_.push_back(hkey.key());
+    lookups_.insert(HashedKey<std::string>(waiting_keys_.back(), hkey.hash()), answer);
+    if (sending_){
+      llock.unlock();
+      return answer.get();
+    }
+    sending_ = true;
+    while (!waiting_.empty()){
+      std::vector<std::string> keys;
+      std::vector<std::promise<Version>> promises;
+      keys.swap(waiting_keys_);
+      promises.swap(waiting_);
+      for (size_t i = 0; i < keys.size(); ++i){
+	lookups_.remove(keys[i]);
+      }
+      llock.unlock();
+      std::vector<Version> versions;
+      std::exception_ptr error;
+      try {
+	/* Only hold others_mutex_ to send, not for the round trip */
+	std::unique_lock<std::mutex> olock(others_mutex_);
+	auto reply = others_[0]->async_call("versions", keys);
+	olock.unlock();
+	versions = reply.get().template as<std::vector<Version>>();
+      } catch (...) {
+	error = std::current_exception();
+      }
+      versions.resize(keys.size());
+      for (size_t i = 0; i < promises.size(); ++i){
+	if (error) promises[i].set_exception(error);
+	else promises[i].set_value(versions[i]);
       }
-      return T();
+      llock.lock();
     }
-    std::unique_lock<std::mutex> lock(others_mutex_);
-    std::pair<bool, size_t> version = others_[0]->call("version", key).template as<std::pair<bool, size_t>>();
-    lock.unlock();
-    if (version.first){
-      return queries_[version.second].val;
+    sending_ = false;
+    llock.unlock();
+    return answer.get();
+  }
+
+  Version version(const std::string& key){
+    Version answer(false, 0);
+    kv_.read(key, [&answer](const versions_t& vers){ answer = std::make_pair(vers.valid, vers.current); });
+    return answer;
+  }
+
+  SharedValue<T> get(const std::string& key){
+    HashedKey<std::string> hkey(key);
+    SharedValue<T> val;
+    if (get_local(hkey, val, commit_wait_)){
+      return val;
     }
-    return T();
+    return value_of(hkey, lookup_version(hkey));
+  }
+
+  /* Followers answer clean keys themselves; every dirty key goes in one versions call */
+  std::vector<SharedValue<T>> mget(const std::vector<std::string>& keys){
+    std::vector<SharedValue<T>> vals(keys.size());
+    std::vector<std::string> dirty;
+    std::vector<size_t> where;
+    for (size_t i = 0; i < keys.size(); ++i){
+      if (!get_local(HashedKey<std::string>(keys[i]), vals[i], 0)){
+	dirty.push_back(keys[i]);
+	where.push_back(i);
+      }
+    }
+    if (dirty.empty()){
+      return vals;
+    }
+    std::vector<Version> versions;
+    try {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      auto reply = others_[0]->async_call("versions", dirty);
+      lock.unlock();
+      versions = reply.get().template as<std::vector<Version>>();
+    } catch (...) {
+      /* Leader unreachable: answer with what this follower has committed */
+      versions.clear();
+    }
+    for (size_t i = 0; i < where.size(); ++i){
+      HashedKey<std::string> hkey(keys[where[i]]);
+      if (i < versions.size()){
+	vals[where[i]] = value_of(hkey, versions[i]);
+      } else {
+	kv_.read(hkey, [&](const versions_t& vers){ vals[where[i]] = vers.value; });
+      }
+    }
+    return vals;
+  }
+
+  /* Answers get(key) without the Leader if it can: always on the Leader, on a follower
+     if key is clean, if its newest version is below the watermark, or if that version
+     commits within wait ms */
+  bool get_local(const HashedKey<std::string>& hkey, SharedValue<T>& val, size_t wait){
+    if (!leader_ && quorum_ != 0 && std::chrono::steady_clock::now().time_since_epoch().count() >= lease_){
+      return false; /* May have missed a committed query */
+    }
+    bool dirty = false;
+    val = SharedValue<T>();
+    kv_.read(hkey, [&](const versions_t& vers){
+	dirty = !leader_ && !vers.versions.empty();
+	if (!dirty) val = vers.value;
+      });
+    if (!dirty){
+      return true;
+    }
+    /* Every query below the Leader's watermark is committed, so if the newest version
+       of key is below it that version is what the Leader would answer */
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    typename KVStore::find_t found = kv_.find(hkey);
+    if (!found.found) return true;
+    val = found.value.value;
+    size_t newest = 0;
+    for (size_t i = 0; i < found.value.versions.size(); ++i){
+      newest = std::max(newest, found.value.versions[i]);
+    }
+    if (newest < committed_){
+      typename QueryTable::find_t q = queries_.find(newest);
+      if (q.found){
+	val = (q.value.action == REMOVE) ? SharedValue<T>() : q.value.val;
+      }
+      return true;
+    }
+    if (wait != 0){
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait);
+      bool settled = commit_cv_[hkey.hash() % COMMIT_STRIPES].wait_until(qlock, deadline, [&](){
+	  found = kv_.find(hkey);
+	  return !found.found || !found.value.versions.contains(newest);
+	});
+      if (settled){ /* newest is committed (or superseded): the committed state is current */
+	val = found.found ? found.value.value : SharedValue<T>();
+	return true;
+      }
+    }
+    return false;
+  }
+
+  /* The value of the version of key the Leader answered with: still staged here, or
+     committed since (then the committed value is that version or a later one) */
+  SharedValue<T> value_of(const HashedKey<std::string>& hkey, const Version& version){
+    if (!version.first){
+      return SharedValue<T>();
+    }
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    typename QueryTable::find_t q = queries_.find(version.second);
+    if (q.found){
+      return q.value.val;
+    }
+    SharedValue<T> val;
+    kv_.read(hkey, [&val](const versions_t& vers){ val = vers.value; });
+    return val;
   }
 
   void put(const std::string& key, const T& val){
     if (leader_){
-      stage(key, val, PUT, next_query_++);
+      enqueue(Event(PUT, key, val));
     } else {
       std::unique_lock<std::mutex> lock(others_mutex_);
-      others_[0]->send("put", key, val); /* All calls must be redirected to leader */
+      outboxes_[0]->send("put", key, val); /* All calls must be redirected to leader */
     }
   }
 
   void remove(const std::string& key){
     if (leader_){
-      stage(key, T(), REMOVE, next_query_++);
+      enqueue(Event(REMOVE, key, T()));
     } else {
       std::unique_lock<std::mutex> lock(others_mutex_);
-      others_[0]->send("remove", key);
+      outboxes_[0]->send("remove", key);
+    }
+  }
+
+  /* The writes of an mput / mremove are staged together as one stage_batch */
+  void mput(const std::vector<std::pair<std::string, T>>& pairs){
+    if (leader_){
+      Event e(MULTI, std::string(), T());
+      e.writes.reserve(pairs.size());
+      for (size_t i = 0; i < pairs.size(); ++i){
+	e.writes.push_back(Staged(pairs[i].first, pairs[i].second, PUT, 0));
+      }
+      enqueue(std::move(e));
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      outboxes_[0]->send("mput", pairs);
+    }
+  }
+
+  void mremove(const std::vector<std::string>& keys){
+    if (leader_){
+      Event e(MULTI, std::string(), T());
+      e.writes.reserve(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i){
+	e.writes.push_back(Staged(keys[i], T(), REMOVE, 0));
+      }
+      enqueue(std::move(e));
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      outboxes_[0]->send("mremove", keys);
+    }
+  }
+
+  /* Atomic: every put and remove commits together, or none do */
+  void txn(const std::vector<std::pair<std::string, T>>& puts, const std::vector<std::string>& removes){
+    if (leader_){
+      Event e(TXN, std::string(), T());
+      e.writes.reserve(puts.size() + removes.size());
+      for (size_t i = 0; i < puts.size(); ++i){
+	e.writes.push_back(Staged(puts[i].first, puts[i].second, PUT, 0));
+      }
+      for (size_t i = 0; i < removes.size(); ++i){
+	e.writes.push_back(Staged(removes[i], T(), REMOVE, 0));
+      }
+      enqueue(std::move(e));
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      outboxes_[0]->send("txn", puts, removes);
+    }
+  }
+
+  /* Blocks (yielding) while the queue is full */
+  void enqueue(Event&& e){
+    while (!events_.push(std::move(e))){
+      std::this_thread::yield();
+    }
+    events_signal_.notify();
+  }
+
+  /* The replication thread: the only consumer of events_.
+     With batch_ > 1 writes are grouped: a group is staged once it holds batch_
+     writes or BATCH_WINDOW us after its first write, whichever comes first. */
+  void replicate(){
+    Event e;
+    std::vector<Staged> group;
+    TIME_STAMP deadline;
+    size_t idle = 0;
+    while (!stopping_){
+      if (!group.empty() && std::chrono::steady_clock::now() >= deadline){
+	stage_group(group);
+      }
+      if (!events_.pop(e)){
+	if (published_ != committed_) publish();
+	if (holding_) release();
+	if (++idle < 64){
+	  std::this_thread::yield();
+	} else {
+	  auto ready = [this](){ return stopping_ || !events_.empty(); };
+	  if (group.empty()) events_signal_.wait_for(ready, std::chrono::milliseconds(REPLICATE_IDLE));
+	  else events_signal_.wait_for(ready, deadline - std::chrono::steady_clock::now());
+	}
+	continue;
+      }
+      idle = 0;
+      switch (e.kind){
+        case PUT:
+        case REMOVE:
+	  if (batch_ <= 1){
+	    stage(e.key, e.val, e.kind, next_query_++);
+	    break;
+	  }
+	  if (group.empty()){
+	    deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(BATCH_WINDOW);
+	  }
+	  group.push_back(Staged(std::move(e.key), std::move(e.val), e.kind, 0));
+	  if (group.size() >= batch_){
+	    stage_group(group);
+	  }
+	  break;
+        case MULTI: /* Whatever was grouped before it goes first */
+	  if (!group.empty()){
+	    stage_group(group);
+	  }
+	  stage_group(e.writes);
+	  break;
+        case TXN:
+	  if (!group.empty()){
+	    stage_group(group);
+	  }
+	  stage_txn(e.writes);
+	  break;
+        case ACKNOWLEDGE:
+	  if (e.last == e.query) acknowledge(e.query, e.index);
+	  else acknowledge_batch(e.query, e.last, e.index);
+	  break;
+      }
+    }
+  }
+
+  /* Leader: stages a group of writes under consecutive queries and sends them to each
+     follower as a single stage_batch. Empties group. */
+  void stage_group(std::vector<Staged>& group){
+    if (group.empty()) return;
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    size_t first = next_query_;
+    TIME_STAMP now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < group.size(); ++i){
+      std::get<3>(group[i]) = next_query_++;
+      stage_local(std::get<0>(group[i]), std::get<1>(group[i]), std::get<2>(group[i]), std::get<3>(group[i]), now, needed());
+    }
+    if (fanout() == 0){
+      for (size_t query = first; query < next_query_; ++query){
+	commit(query);
+      }
+    } else {
+      fan_out(FRAME_STAGE_BATCH, "stage_batch_packed", group, piggyback());
+    }
+    group.clear();
+  }
+
+  /* Sends func(writes, i, watermark) (framed: a frame of type frame) to every follower
+     downstream. writes are encoded once and that buffer is shared by every outbox; only the
+     header (index, watermark) is per follower. On rpclib a follower relays the bytes it got
+     (relay). Assumes thread already has control of others_mutex_ */
+  template <class W>
+  void fan_out(uint8_t frame, const char* func, const W& writes, size_t watermark, const clmdep_msgpack::type::raw_ref* relay = NULL){
+    if (fanout() == 0) return;
+    if (framed_){
+      std::shared_ptr<std::string> body = std::make_shared<std::string>();
+      put_writes(*body, writes);
+      for (size_t i = 0; i < fanout(); ++i){
+	std::string fields;
+	put_varint(fields, i);
+	put_varint(fields, watermark);
+	downstream(i)->send_frame(frame_header(frame, fields, body->size()), body);
+      }
+      return;
+    }
+    Payload packed = (relay != NULL) ? copy_payload(*relay) : pack_payload(writes);
+    for (size_t i = 0; i < fanout(); ++i){
+      downstream(i)->send_packed(func, packed, i, watermark);
     }
   }
 
+  /* Follower: stages a whole batch, then acknowledges all of it at once (in tree mode
+     once its children have) */
+  void stage_batch(const std::vector<Staged>& batch, size_t index, size_t watermark, const clmdep_msgpack::type::raw_ref* relay = NULL){
+    if (batch.empty()) return;
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    TIME_STAMP now = std::chrono::steady_clock::now();
+    slot_ = index;
+    for (size_t i = 0; i < batch.size(); ++i){
+      stage_local(std::get<0>(batch[i]), std::get<1>(batch[i]), std::get<2>(batch[i]), std::get<3>(batch[i]), now, fanout());
+      if (watermark != NO_WATERMARK) staged_.push(std::get<3>(batch[i]));
+    }
+    commit_upto(watermark);
+    fan_out(FRAME_STAGE_BATCH, "stage_batch_packed", batch, watermark, relay);
+    if (fanout() == 0){
+      /* A batch holds consecutive queries */
+      send_acknowledge(upstream(), std::get<3>(batch.front()), std::get<3>(batch.back()), index);
+    }
+  }
+
+  /* Leader: commits once everyone has acknowledged. Follower (tree mode): passes the
+     acknowledgement up once both children have. */
   void acknowledge(size_t query, size_t index){
     std::unique_lock<std::mutex> qlock(queries_mutex_);
-    if (queries_[query].who[index]) return;
-    --queries_[query].acks;
-    queries_[query].who[index] = true;
-    if (queries_[query].acks == 0){
-      std::unique_lock<std::mutex> olock(others_mutex_);
-      commit(query);
+    bool ready = false;
+    queries_.modify(query, [&](Query& q){
+      if (index >= q.who.size() || q.who[index]) return;
+      q.who[index] = true;
+      if (q.acks != 0) ready = (--q.acks == 0);  /* 0: it already has its quorum */
+    });
+    if (!ready && quorum_ == 0) return;
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    if (quorum_ != 0 && caught_up(query, index)){
+      send_commit(outboxes_[index], query);
+    }
+    if (!ready) return;
+    if (leader_){
+      if (quorate(query)) commit(query);
+    } else {
+      send_acknowledge(upstream(), query, query, slot_);
+    }
+  }
+
+  /* Leader: follower index staged every query in [first, last]. Whatever became
+     ready is committed and sent on as one commit_batch per follower. */
+  void acknowledge_batch(size_t first, size_t last, size_t index){
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::vector<size_t> ready;
+    for (size_t query = first; query <= last; ++query){
+      queries_.modify(query, [&](Query& q){
+	if (index >= q.who.size() || q.who[index]) return;
+	q.who[index] = true;
+	if (q.acks != 0 && --q.acks == 0) ready.push_back(query);
+      });
+    }
+    if (ready.empty() && quorum_ == 0) return;
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    if (quorum_ != 0){
+      std::vector<size_t> late, committable;
+      for (size_t query = first; query <= last; ++query){
+	if (caught_up(query, index)) late.push_back(query);
+      }
+      if (!late.empty()){
+	send_commit(outboxes_[index], late);
+      }
+      for (size_t i = 0; i < ready.size(); ++i){
+	if (quorate(ready[i])) committable.push_back(ready[i]);
+      }
+      ready.swap(committable);
+      if (ready.empty()) return;
+    }
+    if (!leader_){ /* Tree mode: the whole subtree has these; pass them up in runs */
+      for (size_t i = 0, j; i < ready.size(); i = j){
+	for (j = i + 1; j < ready.size() && ready[j] == ready[j-1] + 1; ++j);
+	send_acknowledge(upstream(), ready[i], ready[j-1], slot_);
+      }
+      return;
+    }
+    for (size_t i = 0; i < ready.size(); ++i){
+      commit_local(ready[i]);
+    }
+    if (pipeline_) return;  /* Carried by the watermark */
+    for (size_t i = 0; i < fanout(); ++i){
+      if (quorum_ == 0){
+	send_commit(downstream(i), ready);
+	continue;
+      }
+      std::vector<size_t> acked;  /* The rest go out as i acknowledges them */
+      for (size_t r = 0; r < ready.size(); ++r){
+	if (lagging_[i].count(ready[r]) == 0) acked.push_back(ready[r]);
+      }
+      if (!acked.empty()) send_commit(downstream(i), acked);
+    }
+  }
+
+  /* Acknowledgements the Leader waits for before committing a query (a follower: its children) */
+  size_t needed() const {
+    if (!leader_ || quorum_ == 0) return fanout();
+    size_t k = (quorum_ == MAJORITY) ? (others_.size() + 1) / 2 : quorum_;
+    return std::min(k, others_.size());
+  }
+
+  /* Leader (quorum mode): query has its quorum. Notes who it goes without and returns
+     whether it can commit now; otherwise it waits in held_ for their leases to run out.
+     Assumes thread already have control of queries_mutex_ and others_mutex_ */
+  bool quorate(size_t query){
+    if (quorum_ == 0) return true;
+    const std::vector<bool>& who = queries_[query].who;
+    for (size_t i = 0; i < who.size() && i < lagging_.size(); ++i){
+      if (!who[i]) lagging_[i].insert(query);
+    }
+    if (leased_out(query)){
+      held_.push_back(query);
+      holding_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  /* Leader: does a follower that hasn't acknowledged query still hold a lease? */
+  bool leased_out(size_t query){
+    const std::vector<bool>& who = queries_[query].who;
+    TIME_STAMP now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < who.size() && i < leases_.size(); ++i){
+      if (!who[i] && now < leases_[i]) return true;
+    }
+    return false;
+  }
+
+  /* Leader (quorum mode): commits the held queries whose leases have run out, in order */
+  void release(){
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    size_t kept = 0;
+    for (size_t i = 0; i < held_.size(); ++i){
+      if (kept == 0 && !leased_out(held_[i])){
+	commit(held_[i]);
+      } else {
+	held_[kept++] = held_[i];
+      }
+    }
+    held_.resize(kept);
+    holding_ = (kept != 0);
+  }
+
+  /* Leader (quorum mode): follower index acknowledged query after it got its quorum.
+     Returns true if query has committed since, so index needs its commit (a held query
+     sends it on release). Assumes thread already have control of queries_mutex_ and others_mutex_ */
+  bool caught_up(size_t query, size_t index){
+    if (!leader_ || index >= lagging_.size() || lagging_[index].erase(query) == 0) return false;
+    if (pipeline_) return false;  /* Carried by the watermark */
+    return !queries_.find(query).found;
+  }
+
+  /* Leader: leases follower (addr, port) LEASE_TIME ms if it isn't missing a commit */
+  bool lease(const std::string& addr, size_t port){
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    std::pair<std::string, size_t> look(addr, port);
+    for (size_t i = 0; i < others_id_.size() && i < lagging_.size(); ++i){
+      if (others_id_[i] != look) continue;
+      if (!lagging_[i].empty()) return false;
+      leases_[i] = std::chrono::steady_clock::now() + std::chrono::milliseconds(LEASE_TIME);
+      return true;
+    }
+    return false;
+  }
+
+  /* Follower (quorum mode): keeps asking the Leader for a lease. A lease counts from
+     before the request was sent, and is cut short for clock drift, so it always runs out
+     here before it does on the Leader. */
+  void renew(const std::string& addr, size_t port){
+    while (!stopping_){
+      TIME_STAMP start = std::chrono::steady_clock::now();
+      try {
+	std::unique_lock<std::mutex> olock(others_mutex_);
+	auto reply = others_[0]->async_call("lease", addr, port);
+	olock.unlock();
+	if (reply.wait_for(std::chrono::milliseconds(LEASE_TIME)) == std::future_status::ready && reply.get().template as<bool>()){
+	  lease_ = (start + std::chrono::milliseconds(LEASE_TIME * 9 / 10)).time_since_epoch().count();
+	}
+      } catch (...) {
+	/* No lease this time */
+      }
+      std::this_thread::sleep_until(start + std::chrono::milliseconds(LEASE_TIME / 4));
+    }
+  }
+
+  /* Followers the Leader sends to (all, or in tree mode its children); a follower's children */
+  size_t fanout() const {
+    if (!leader_) return (left_ != NULL) + (right_ != NULL);
+    return tree_ ? std::min(others_.size(), (size_t)2) : others_.size();
+  }
+
+  Outbox* downstream(size_t i) const {
+    if (!leader_) return (i == 0 && left_ != NULL) ? left_out_ : right_out_; /* left_ may be missing (see reconnect) */
+    return outboxes_[i];
+  }
+
+  /* Follower: where its acknowledgements go */
+  Outbox* upstream() const {
+    return parent_ != NULL ? parent_out_ : outboxes_[0];
+  }
+
+  /* Follower: (re)connects one of parent_, left_, right_ to addr ("" for none).
+     Gives up after TREE_CONNECT_TIME ms, leaving it NULL (see cut_off) */
+  void reconnect(rpc::client*& client, Outbox*& out, std::pair<std::string, size_t>& current, const std::pair<std::string, size_t>& addr){
+    if (client != NULL && current == addr) return;
+    delete out;
+    delete client;
+    out = NULL;
+    client = NULL;
+    current = addr;
+    if (addr.first == "") return;
+    client = new rpc::client(addr.first, addr.second);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TREE_CONNECT_TIME);
+    while (client->get_connection_state() != rpc::client::connection_state::connected){
+      if (std::chrono::steady_clock::now() >= deadline){
+	delete client;
+	client = NULL;
+	return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    out = outbox_to(client, addr.first, addr.second);
+  }
+
+  /* Follower: can't reach its parent or a child it was given, or a child fell too far
+     behind. It then stops answering the heartbeat, so the Leader culls it and rebuilds
+     the tree. Assumes thread already has control of others_mutex_ */
+  bool cut_off() const {
+    const rpc::client* family[3] = { parent_, left_, right_ };
+    for (size_t i = 0; i < family_.size(); ++i){
+      if (family_[i].first != "" && family[i] == NULL) return true;
+    }
+    for (size_t i = 0; i < fanout(); ++i){
+      if (downstream(i)->failed()) return true;
+    }
+    return false;
+  }
+
+  /* Follower: takes its place in the tree (parent "" is the Leader) */
+  void plant(const std::pair<std::string, size_t>& parent, const std::vector<std::pair<std::string, size_t>>& children, size_t slot){
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    std::pair<std::string, size_t> none("", 0);
+    family_.resize(3, none);
+    reconnect(parent_, parent_out_, family_[0], parent);
+    reconnect(left_, left_out_, family_[1], children.size() > 0 ? children[0] : none);
+    reconnect(right_, right_out_, family_[2], children.size() > 1 ? children[1] : none);
+    slot_ = slot;
+  }
+
+  /* Leader (tree mode): tells every follower its place in the tree. Waits for each, so no
+     stage sent afterwards can reach a node that doesn't know its children yet.
+     Assumes thread already has control of others_mutex_ */
+  void build_tree(){
+    std::pair<std::string, size_t> leader("", 0);
+    for (size_t i = 0; i < others_id_.size(); ++i){
+      std::vector<std::pair<std::string, size_t>> children;
+      for (size_t c = 2*i + 2; c < 2*i + 4 && c < others_id_.size(); ++c){
+	children.push_back(others_id_[c]);
+      }
+      try {
+	others_[i]->call("tree", i < 2 ? leader : others_id_[(i - 2) / 2], children, i % 2);
+      } catch (...) {
+	/* Left to the heartbeat */
+      }
+    }
+  }
+
+  /* Leader (tree mode): after the tree changed, sends every query in progress down it again.
+     Followers that already staged a query only pass it on and acknowledge it again.
+     Assumes thread already have control of queries_mutex_ and others_mutex_ */
+  void restage(){
+    std::vector<size_t> pending;
+    typename QueryTable::iterator it;
+    for (it = queries_.begin(); it != queries_.end(); ++it){
+      Query& q = (*it).value;
+      q.who.assign(fanout(), q.span == 0);
+      q.acks = (q.span == 0) ? 0 : fanout();
+      if (q.span != 0) pending.push_back((*it).key);
+    }
+    size_t watermark = piggyback();
+    for (size_t p = 0; p < pending.size(); ++p){
+      size_t query = pending[p];
+      if (fanout() == 0){
+	commit(query);
+	continue;
+      }
+      typename QueryTable::find_t q = queries_.find(query);
+      std::vector<Staged> writes;
+      for (size_t i = 0; i < q.value.span; ++i){
+	typename QueryTable::find_t w = queries_.find(query + i);
+	writes.push_back(Staged(w.value.key, w.value.val.get(), w.value.action, query + i));
+      }
+      if (q.value.span > 1) fan_out(FRAME_STAGE_TXN, "stage_txn_packed", writes, watermark);
+      else fan_out(FRAME_STAGE, "stage_packed", writes.front(), watermark);
     }
   }
 
@@ -175,15 +1127,27 @@ class Server {
     
     /* Send all of the in progress queries / staged versions */
     std::vector<std::future<clmdep_msgpack::object_handle>> futures;
-    typename HashTable<size_t, Query>::iterator qit;
+    typename QueryTable::iterator qit;
+    size_t slot = tree_ ? NO_SLOT : ind; /* In tree mode who counts children: nobody waits on the new node */
     for (qit = queries_.begin(); qit != queries_.end(); ++qit){
-      if ((*qit).value.action == DONE){   /* Commited Value */
-	(*qit).value.who.push_back(true);
-      } else {
+      if ((*qit).value.span == 0){ /* Sent with the first query of its transaction */
+	if (!tree_) (*qit).value.who.push_back(true);
+	continue;
+      }
+      if (!tree_){ /* In tree mode who is left alone */
         (*qit).value.who.push_back(false);
-        ++(*qit).value.acks;
+        if (quorum_ == 0) ++(*qit).value.acks;
       }
-      others_[ind]->call("stage", (*qit).value.key, (*qit).value.val, (*qit).value.action, (*qit).key, ind);
+      if ((*qit).value.span > 1){
+	std::vector<Staged> writes;
+	for (size_t i = 0; i < (*qit).value.span; ++i){
+	  typename QueryTable::find_t w = queries_.find((*qit).key + i);
+	  writes.push_back(Staged(w.value.key, w.value.val.get(), w.value.action, (*qit).key + i));
+	}
+	others_[ind]->call("stage_txn", writes, slot, piggyback());
+	continue;
+      }
+      others_[ind]->call("stage", (*qit).value.key, (*qit).value.val, (*qit).value.action, (*qit).key, slot, piggyback());
     }
     /* Make sure everything got there -- If it fails be pessemistic */
     for (size_t i = 0; i < futures.size(); ++i){
@@ -197,11 +1161,11 @@ class Server {
     /* We've successfully got the new follower upto speed on all staged versions */
     futures.clear();
 
-    /* Send all commited data (Reconstructs from queries and using commit) */
-    typename KeyValueStore<std::string,versions_t>::iterator it;
+    /* Send all commited data (each key's committed value, staged as DONE) */
+    typename KVStore::iterator it;
     for (it = kv_.begin(); it != kv_.end(); ++it){
       if ((*it).value.valid){
-        futures.push_back(others_[ind]->async_call("commit", (*it).value.current));
+        futures.push_back(others_[ind]->async_call("stage", (*it).key, (*it).value.value, (Action)DONE, (*it).value.current, slot, NO_WATERMARK));
       }
     }
     /* Make sure everything got there -- If it fails be pessemistic */
@@ -216,7 +1180,13 @@ class Server {
     /* The new node is all caught up and is ready to join the party :) */
     std::unique_lock<std::mutex> alock(alive_mutex_);
     others_id_.push_back(std::make_pair(addr, port));
+    outboxes_.push_back(outbox_to(others_[ind], addr, port));
     alive_.push_back(true);  /* The new node is infact still alive ... */
+    lagging_.push_back(std::set<size_t>());
+    leases_.push_back(TIME_STAMP());
+    if (tree_){
+      build_tree();
+    }
     try {
       others_[ind]->call("ready");
     } catch (...) {
@@ -224,90 +1194,211 @@ class Server {
     }
   }
 
-  void stage(const std::string& key, const T& val, Action act, size_t query, size_t index = 0){
-    /* Add this version to the version history of key */
-    typename KeyValueStore<std::string, versions_t>::find_t found = kv_.find(key);
-    versions_t vers = versions_t();
-    if (found.found){
-      vers = found.value;
-    }
-    vers.versions.insert(query);
-    kv_.put(key, vers);
-    /* Continue with normal staging of 2pc */
+  void stage(const std::string& key, const T& val, Action act, size_t query, size_t index = 0, size_t watermark = NO_WATERMARK, const clmdep_msgpack::type::raw_ref* relay = NULL){
+    /* All writers of kv_ hold queries_mutex_, so this read-modify-write can't interleave with commit */
     std::unique_lock<std::mutex> qlock(queries_mutex_);
     std::unique_lock<std::mutex> olock(others_mutex_);
+    /* Continue with normal staging of 2pc */
     if (leader_){
-      queries_.insert(query, Query(key, val, act, std::chrono::steady_clock::now(), others_.size()));
-      if (others_.size() == 0){
+      stage_local(key, val, act, query, std::chrono::steady_clock::now(), needed());
+      if (fanout() == 0){
 	commit(query);
 	return;
       }
-      for (size_t i = 0; i < others_.size(); ++i){
-        others_[i]->send("stage", key, val, act, query, i);
-      }
+      fan_out(FRAME_STAGE, "stage_packed", Staged(key, val, act, query), piggyback());
     }
     else {
-      queries_.insert(query, Query(key, val, act, std::chrono::steady_clock::now()));
-      if (act != DONE){ /* Only sent when joining */
-        others_[0]->send("acknowledge", query, index);
+      if (act == DONE){ /* A committed value, only sent when joining */
+	HashedKey<std::string> hkey(key);
+	kv_.upsert(hkey, [&](versions_t& vers){
+	    vers.current = query;
+	    vers.valid = true;
+	    vers.value = val;
+	  });
+	return;
+      }
+      if (index != NO_SLOT) slot_ = index;
+      if (!restaged(query)){
+	stage_local(key, val, act, query, std::chrono::steady_clock::now(), fanout());
+	if (watermark != NO_WATERMARK) staged_.push(query);
+      }
+      commit_upto(watermark);
+      if (fanout() != 0){
+	fan_out(FRAME_STAGE, "stage_packed", Staged(key, val, act, query), watermark, relay);
       }
+      if (fanout() == 0){
+        send_acknowledge(upstream(), query, query, index);
+      }
+    }
+  }
+
+  /* Follower: if query is already staged (the Leader restaged it after the tree changed)
+     waits for its current children again instead of staging it twice */
+  bool restaged(size_t query){
+    size_t children = fanout();
+    return queries_.modify(query, [children](Query& q){
+      q.who.assign(children, false);
+      q.acks = children;
+    });
+  }
+
+  /* Leader: the watermark to piggyback on an outgoing message.
+     Assumes thread already has control of others_mutex_ */
+  size_t piggyback(){
+    published_ = committed_.load();
+    return published_;
+  }
+
+  /* Leader: sends the watermark on its own (nothing else is going out) */
+  void publish(){
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    size_t watermark = piggyback();
+    for (size_t i = 0; i < fanout(); ++i){
+      send_commit_upto(downstream(i), watermark);
+    }
+  }
+
+  /* Follower: commits (oldest first) every query it staged below watermark that is still
+     in progress. Assumes thread already have control of queries_mutex_ and others_mutex_ */
+  void commit_upto(size_t watermark){
+    if (watermark == NO_WATERMARK) return;
+    if (committed_ < watermark) committed_ = watermark;
+    while (!staged_.empty() && staged_.top() < watermark){
+      size_t query = staged_.top();
+      staged_.pop();
+      commit_local(query); /* Children get the watermark too */
     }
   }
 
+  /* A transaction's writes are staged as consecutive queries (one per write, so every key
+     gets a version of its own), but only the first is acknowledged and committed: one
+     stage_txn, one acknowledge and one commit per follower for the whole transaction */
+  void stage_txn(std::vector<Staged>& writes, size_t index = 0, size_t watermark = NO_WATERMARK, const clmdep_msgpack::type::raw_ref* relay = NULL){
+    if (writes.empty()) return;
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    TIME_STAMP now = std::chrono::steady_clock::now();
+    if (leader_){
+      for (size_t i = 0; i < writes.size(); ++i){
+	std::get<3>(writes[i]) = next_query_++;
+      }
+    }
+    size_t first = std::get<3>(writes.front());
+    if (!leader_ && index != NO_SLOT) slot_ = index;
+    bool again = !leader_ && restaged(first);
+    for (size_t i = 0; i < writes.size() && !again; ++i){
+      size_t query = std::get<3>(writes[i]);
+      stage_local(std::get<0>(writes[i]), std::get<1>(writes[i]), std::get<2>(writes[i]), query, now, (i == 0) ? needed() : 0);
+      Query& q = queries_[query];
+      q.span = (i == 0) ? writes.size() : 0;
+      if (i != 0){
+	q.who.assign(fanout(), true);  /* Never waits on anyone itself */
+      }
+    }
+    if (leader_ && fanout() == 0){
+      commit(first);
+      return;
+    }
+    if (leader_){
+      watermark = piggyback();
+    } else if (!again && watermark != NO_WATERMARK){
+      staged_.push(first);
+    }
+    fan_out(FRAME_STAGE_TXN, "stage_txn_packed", writes, watermark, relay);
+    if (!leader_){
+      if (fanout() == 0){
+	send_acknowledge(upstream(), first, first, index);
+      }
+      commit_upto(watermark);
+    }
+  }
+
+  /* Adds query to the version history of key and to the in progress queries.
+     Assumes thread already have control of queries_mutex_ and others_mutex_ */
+  void stage_local(const std::string& key, const SharedValue<T>& val, Action act, size_t query, TIME_STAMP now, size_t acks = 0){
+    HashedKey<std::string> hkey(key);
+    kv_.upsert(hkey, [query](versions_t& vers){ vers.versions.insert(query); });
+    queries_.insert(query, Query(key, hkey.hash(), val, act, now, acks, fanout()));
+  }
+
   /* Assumes thread already have control of queries_mutex_ and others_mutex_ */
   void commit(size_t query){
-    Query q = queries_[query];
-    versions_t vers = kv_.get(q.key); /* q.key must be in the kv_ (it was inserted in stage) */
-    switch (q.action){
-      case PUT:
-	if (vers.valid){
-	  queries_.remove(vers.current);
-	  vers.versions.remove_element(vers.current);
-	}
-	vers.current = query;
-	vers.valid = true;
-	kv_.put(q.key, vers);
-	queries_[query].action = DONE; /* This is the most recently commited query for key */
-        break;
-      case REMOVE:
-	if (vers.valid){
-	  queries_.remove(vers.current);
-	  vers.versions.remove_element(query);
-	}
-	queries_.remove(query);
-	vers.versions.remove_element(query);
-	if (vers.versions.size() != 0){
+    commit_local(query);
+    if (leader_ && pipeline_) return;  /* Carried by the watermark */
+    for (size_t i = 0; i < fanout(); ++i){
+      if (leader_ && quorum_ != 0 && lagging_[i].count(query) != 0) continue; /* Sent when it acknowledges */
+      send_commit(downstream(i), query);
+    }
+  }
+
+  /* Applies a commit to self only; a transaction applies all of its queries at once.
+     Committed queries leave queries_, so committing one again does nothing. */
+  void commit_local(size_t query){
+    size_t span = 0;
+    queries_.modify(query, [&span](Query& q){ span = std::max(q.span, (size_t)1); });
+    for (size_t i = 0; i < span; ++i){
+      apply(query + i);
+    }
+  }
+
+  /* Commits one query (the Leader also records how long it took): its value moves into
+     the key's record and the query leaves queries_ */
+  void apply(size_t query){
+    /* Copy out what is needed before q is removed (val is shared, not copied) */
+    Query& q = queries_[query];
+    std::string key = q.key;
+    HashedKey<std::string> hkey(key, q.hash);
+    Action action = q.action;
+    TIME_STAMP time = q.time;
+    SharedValue<T> val = q.val;
+    bool erase = false;     /* Is key left without any version? */
+    kv_.modify(hkey, [&](versions_t& vers){ /* key must be in the kv_ (it was inserted in stage) */
+      vers.versions.remove_element(query);
+      switch (action){
+        case PUT:
+	  vers.current = query;
+	  vers.valid = true;
+	  vers.value = std::move(val);
+	  break;
+        case REMOVE:
 	  vers.valid = false;
-	  kv_.put(q.key, vers);
-	} else {
-	  kv_.remove(q.key);
-	}
-        break;
-      case DONE: /* This is the current successfully commited value -- sent during a join request */
-	vers.current = query;
-	vers.valid = true;
-	kv_.put(q.key, vers);
-	break;
+	  vers.value = SharedValue<T>();
+	  erase = (vers.versions.size() == 0);
+	  break;
+      }
+    });
+    queries_.remove(query);
+    if (erase){
+      kv_.remove(hkey);
+    }
+    if (commit_wait_ != 0){
+      commit_cv_[hkey.hash() % COMMIT_STRIPES].notify_all();
     }
     if (leader_){
-      for (size_t i = 0; i < others_.size(); ++i){
-	others_[i]->send("commit", query);
+      /* Advance the watermark past every contiguously committed query */
+      if (query >= committed_) done_.push(query);
+      while (!done_.empty() && done_.top() <= committed_){
+	if (done_.top() == committed_) ++committed_;
+	done_.pop();
       }
       auto now = std::chrono::steady_clock::now();
-      size_t taken = std::chrono::duration_cast<std::chrono::nanoseconds>(now - q.time).count();
+      size_t taken = std::chrono::duration_cast<std::chrono::nanoseconds>(now - time).count();
       std::unique_lock<std::mutex> tlock(times_mutex_);
-      times_.push_back(time_info(q.time, taken, q.action));
+      times_.push_back(time_info(time, taken, action));
     }
   }
 
-  void alive(size_t index){
+  void alive(size_t index, size_t watermark = NO_WATERMARK){
     if (leader_){
       std::unique_lock<std::mutex> lock(alive_mutex_);
       alive_[index] = true;
     } else {
+      std::unique_lock<std::mutex> qlock(queries_mutex_);
       std::unique_lock<std::mutex> lock(others_mutex_);
       pulse_ = true;
-      others_[0]->send("alive", index);
+      commit_upto(watermark);
+      if (cut_off()) return;
+      send_alive(outboxes_[0], index, NO_WATERMARK);
     }
   }
 
@@ -326,40 +1417,90 @@ class Server {
     std::unique_lock<std::mutex> qlock(queries_mutex_);
     std::unique_lock<std::mutex> olock(others_mutex_);
     std::unique_lock<std::mutex> alock(alive_mutex_);
-    typename HashTable<size_t, Query>::iterator it;
+    typename QueryTable::iterator it;
     for (int i = dead.size()-1; 0 <= i; --i){
+      delete outboxes_[dead[i]];
       delete others_[dead[i]];
+      outboxes_.erase(outboxes_.begin()+dead[i]);
       others_.erase(others_.begin()+dead[i]);
       others_id_.erase(others_id_.begin()+dead[i]);
       alive_.erase(alive_.begin()+dead[i]);
-      /* Acknowledge on behalf of dead nodes */
+      lagging_.erase(lagging_.begin()+dead[i]);
+      leases_.erase(leases_.begin()+dead[i]);
+      if (tree_) continue;  /* The tree is rebuilt and restaged below */
+      if (quorum_ != 0){ /* Fewer followers may need fewer acknowledgements */
+	std::vector<size_t> ready;
+	for (it = queries_.begin(); it != queries_.end(); ++it){
+	  Query& q = (*it).value;
+	  if (dead[i] < q.who.size()) q.who.erase(q.who.begin()+dead[i]);
+	  if (q.acks == 0) continue;
+	  size_t acked = std::count(q.who.begin(), q.who.end(), true);
+	  q.acks = (needed() > acked) ? needed() - acked : 0;
+	  if (q.acks == 0) ready.push_back((*it).key);
+	}
+	for (size_t r = 0; r < ready.size(); ++r){
+	  if (quorate(ready[r])) commit(ready[r]);
+	}
+	continue;
+      }
+      /* Acknowledge on behalf of dead nodes (committing removes queries, so commit after) */
+      std::vector<size_t> ready;
       for (it = queries_.begin(); it != queries_.end(); ++it){
 	if (!(*it).value.who[dead[i]])
 	  --(*it).value.acks;
 	(*it).value.who.erase((*it).value.who.begin()+dead[i]);
-        if ((*it).value.acks == 0){
-          commit((*it).key);
+        if ((*it).value.acks == 0 && (*it).value.span != 0){ /* The rest of a transaction commits with its first */
+          ready.push_back((*it).key);
         }
       }
+      for (size_t r = 0; r < ready.size(); ++r){
+	commit(ready[r]);
+      }
+    }
+    if (tree_){
+      build_tree();
+      restage();
     }
   }
   
  public:
-   Server(size_t port=8080) : self_(new rpc::server(port)), leader_(false), ready_(false), pulse_(false), next_query_(0) {
+   Server(size_t port=8080, size_t threads=1, size_t batch=1, bool pipeline=false, size_t commit_wait=0, bool tree=false, size_t quorum=0, bool framed=false) : self_(new rpc::server(port)), leader_(false), ready_(false), pulse_(false), next_query_(0), threads_(threads), batch_(batch), pipeline_(pipeline), committed_(0), published_(0), tree_(tree), parent_(NULL), left_(NULL), right_(NULL), parent_out_(NULL), left_out_(NULL), right_out_(NULL), slot_(0), quorum_(tree ? 0 : quorum), holding_(false), lease_(0), commit_wait_(commit_wait), sending_(false), framed_(framed), channel_(NULL), events_(EVENT_QUEUE), stopping_(false) {
     register_funcs();
   }
 
   ~Server(){
+    stopping_ = true;
+    events_signal_.wake();
+    delete channel_;  /* First: its readers call in */
+    if (replicator_.joinable()){
+      replicator_.join();
+    }
+    if (leaser_.joinable()){
+      leaser_.join();
+    }
+    for (size_t i = 0; i < outboxes_.size(); ++i){
+      delete outboxes_[i];
+    }
     for (size_t i = 0; i < others_.size(); ++i){
       delete others_[i];
     }
+    delete parent_out_;
+    delete left_out_;
+    delete right_out_;
+    delete parent_;
+    delete left_;
+    delete right_;
   }
 
   void run(std::string self_addr, size_t self_port, std::string address, size_t port){
     rpc::client client(address, port);
     std::pair<std::string, size_t> leader = client.call("leader", self_addr, self_port).as<std::pair<std::string, size_t>>();
-    self_->async_run();
+    if (framed_ && channel_ == NULL){
+      channel_ = new ChannelServer(self_port + CHANNEL_PORT_OFFSET, [this](uint8_t type, FrameReader& in){ this->on_frame(type, in); });
+    }
+    self_->async_run(threads_);
     if (leader == std::make_pair(self_addr, self_port)){
+      replicator_ = std::thread([this](){ this->replicate(); });
       leader_ = true;
       ready_ = true;
       pulse_ = true;
@@ -369,9 +1510,10 @@ class Server {
 
 	std::vector<size_t> dead;
 	{
+	  std::unique_lock<std::mutex> olock(others_mutex_);
 	  std::unique_lock<std::mutex> lock(alive_mutex_);
   	  for (int i = 0; i < alive_.size(); ++i){
-	    if (!alive_[i]){
+	    if (!alive_[i] || outboxes_[i]->failed()){ /* Silent, or too far behind to catch up */
 	      dead.push_back(i);
 	    }
 	    alive_[i] = false;
@@ -384,7 +1526,7 @@ class Server {
 	{
 	  std::unique_lock<std::mutex> lock(others_mutex_);
   	  for (int i = 0; i < others_.size(); ++i){
-	    others_[i]->send("alive", i);
+	    send_alive(outboxes_[i], i, piggyback());
 	  }
 	}
 	
@@ -413,11 +1555,15 @@ class Server {
     } else {
       others_.push_back(new rpc::client(leader.first, leader.second));
       while (others_[0]->get_connection_state() != rpc::client::connection_state::connected);
+      outboxes_.push_back(outbox_to(others_[0], leader.first, leader.second));
       others_[0]->send("join", self_addr, self_port);
       while (!ready_){
 	std::this_thread::sleep_for(std::chrono::milliseconds(100)); /* sleep for 100 ms and check again */
       }
       pulse_ = true;
+      if (quorum_ != 0){
+	leaser_ = std::thread([this, self_addr, self_port](){ this->renew(self_addr, self_port); });
+      }
       while(1){
 	auto start = std::chrono::steady_clock::now();
 	if (!pulse_){
@@ -437,15 +1583,26 @@ class Server {
 	    self_ = new rpc::server(self_port);
 	    register_funcs();
 	    lock.unlock();
-	    kv_ = KeyValueStore<std::string, versions_t>();
-	    queries_ = HashTable<size_t, Query>();
+	    delete channel_; /* Its readers call in too: stopped (after the lock, as they may wait on it) */
+	    channel_ = NULL;
+	    lease_ = 0;
+	    kv_ = KVStore();
+	    queries_ = QueryTable();
 	    ready_ = false;
-	    while (others_[0]->get_connection_state() != rpc::client::connection_state::connected){
+	    for (;;){
+	      std::unique_lock<std::mutex> swap(others_mutex_); /* leaser_ uses others_[0] */
+	      if (others_[0]->get_connection_state() == rpc::client::connection_state::connected) break;
+	      delete outboxes_[0];
   	      delete others_[0];
 	      others_[0] = new rpc::client(leader.first, leader.second);
+	      outboxes_[0] = outbox_to(others_[0], leader.first, leader.second);
+	      swap.unlock();
 	      std::this_thread::sleep_for(std::chrono::milliseconds(ALIVE_TIME));
 	    }
-	    self_->async_run();
+	    if (framed_){
+	      channel_ = new ChannelServer(self_port + CHANNEL_PORT_OFFSET, [this](uint8_t type, FrameReader& in){ this->on_frame(type, in); });
+	    }
+	    self_->async_run(threads_);
 	    std::this_thread::sleep_for(std::chrono::milliseconds(ALIVE_TIME));
 	    others_[0]->send("join", self_addr, self_port);
             while (!ready_){
@@ -12,6 +12,8 @@
 #include "rpc/client.h"
 #include "key_value.h"
 #include "hash_table.h"
+#include "slab_allocator.h"
+#include "shared_value.h"
 #include <vector>
 #include <string>
 #include <iostream>
@@ -20,6 +22,7 @@
 #include <mutex>
 #include <atomic>
 #include <chrono>
+#include <tuple>
 
 #ifndef CM_SERVER_2PC
 #define CM_SERVER_2PC
@@ -39,16 +42,23 @@ class Server {
   std::atomic<bool> ready_;                              /* Am I finished joining the system? */
   std::atomic<bool> pulse_;                              /* Has the Leader contacted me recently? */
   
-  KeyValueStore<std::string, T> kv_;                     /* self's key value storage */
+  /* Entries and key bytes of both tables live in slab pools, declared first so they outlive the tables */
+  SlabPool kv_pool_;
+  SlabPool queries_pool_;
+
+  /* Values are shared (not copied) between queries_, kv_ and get responses */
+  typedef KeyValueStore<SlabString, SharedValue<T>, HashTable<SlabString, SharedValue<T>, SlabAllocator<char>>> KVStore;
+  KVStore kv_;                                           /* self's key value storage */
 
   typedef char Action;
   typedef std::chrono::steady_clock::time_point TIME_STAMP;
 
   struct Query{
     Query() {}
-    Query(const std::string& k, const T& val, Action act, TIME_STAMP now, size_t a = 0) : key(k), val(val), action(act), time(now), acks(a) { who.resize(a, false); }
+    Query(const std::string& k, size_t h, const SharedValue<T>& val, Action act, TIME_STAMP now, size_t a = 0) : key(k), hash(h), val(val), action(act), time(now), acks(a) { who.resize(a, false); }
     std::string key;
-    T val;
+    size_t hash;           /* KeyHash of key, computed once in stage */
+    SharedValue<T> val;
     Action action;
     std::vector<bool> who;
     TIME_STAMP time;
@@ -65,11 +75,16 @@ class Server {
 
   std::vector<time_info> times_;
 
+  /* One write of a stage_batch: (key, val, action, query) */
+  typedef std::tuple<std::string, T, Action, size_t> Staged;
+
   /* The set of inprogress commits */
-  HashTable<size_t, Query> queries_;
+  typedef HashTable<size_t, Query, SlabAllocator<char>> QueryTable;
+  QueryTable queries_;
   size_t next_query_;
 
-  /* Locks for multi-thread access to the respective containers */
+  /* Locks for multi-thread access to the respective containers;
+     nested locks are always taken others, queries, alive (as in 2PC-AQ) */
   std::mutex alive_mutex_;
   std::mutex others_mutex_;
   std::mutex queries_mutex_;
@@ -79,25 +94,37 @@ class Server {
     self_->bind("get", [this](std::string key){ return this->get(key); });
     self_->bind("put", [this](std::string key, T val){ this->put(key, val); });
     self_->bind("remove", [this](std::string key){ this->remove(key); });
+    self_->bind("mget", [this](std::vector<std::string> keys){ return this->mget(keys); });
+    self_->bind("mput", [this](std::vector<std::pair<std::string, T>> pairs){ this->mput(pairs); });
+    self_->bind("mremove", [this](std::vector<std::string> keys){ this->mremove(keys); });
     self_->bind("acknowledge", [this](size_t query, size_t index){ this->acknowledge(query, index); });
+    self_->bind("acknowledge_batch", [this](size_t first, size_t last, size_t index){ this->acknowledge_batch(first, last, index); });
     self_->bind("join", [this](std::string address, size_t port = 8080){ this->join(address, port); });
     self_->bind("stage", [this](std::string key, T val, Action act, size_t query, size_t index){ this->stage(key, val, act, query, index); });
+    self_->bind("stage_batch", [this](std::vector<Staged> batch, size_t index){ this->stage_batch(batch, index); });
     self_->bind("commit", [this](size_t query){ this->commit(query); });
-    self_->bind("set", [this](std::string key, T val){ this->kv_.put(key, val); });
+    self_->bind("commit_batch", [this](std::vector<size_t> queries){
+	std::unique_lock<std::mutex> olock(this->others_mutex_);
+	std::unique_lock<std::mutex> qlock(this->queries_mutex_);
+	for (size_t i = 0; i < queries.size(); ++i){
+	  this->commit(queries[i]);
+	}
+      });
+    self_->bind("set", [this](std::string key, T val){ this->kv_.put(HashedKey<std::string>(key), val); });
     self_->bind("ready", [this](){ this->ready_ = true; });
     /* Testing aliveness */
     self_->bind("alive", [this](size_t index){ this->alive(index); });
     self_->bind("check", [this](std::string addr, size_t port){ return this->check(addr, port); });
     self_->bind("ping", [](){});
     /* For Testing Purposes */
-    self_->bind("GET", [this](std::string key){ return this->kv_.get(key); });
+    self_->bind("GET", [this](std::string key){ return this->kv_.get(HashedKey<std::string>(key)); });
   }
 
-  T get(const std::string& key){
+  SharedValue<T> get(const std::string& key){
     if (leader_)
-      return kv_.get(key);
+      return kv_.get(HashedKey<std::string>(key));
     std::unique_lock<std::mutex> lock(others_mutex_);
-    return others_[0]->call("get", key).template as<T>();
+    return others_[0]->call("get", key).template as<SharedValue<T>>();
   }
 
   void put(const std::string& key, const T& val){
@@ -119,24 +146,88 @@ class Server {
     }
   }
 
+  std::vector<SharedValue<T>> mget(const std::vector<std::string>& keys){
+    if (leader_){
+      std::vector<SharedValue<T>> vals;
+      vals.reserve(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i){
+	vals.push_back(kv_.get(HashedKey<std::string>(keys[i])));
+      }
+      return vals;
+    }
+    std::unique_lock<std::mutex> lock(others_mutex_);
+    return others_[0]->call("mget", keys).template as<std::vector<SharedValue<T>>>();
+  }
+
+  /* The writes of an mput / mremove are staged together as one stage_batch */
+  void mput(const std::vector<std::pair<std::string, T>>& pairs){
+    if (leader_){
+      std::vector<Staged> batch;
+      batch.reserve(pairs.size());
+      for (size_t i = 0; i < pairs.size(); ++i){
+	batch.push_back(Staged(pairs[i].first, pairs[i].second, PUT, 0));
+      }
+      stage_batch(batch);
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      others_[0]->send("mput", pairs);
+    }
+  }
+
+  void mremove(const std::vector<std::string>& keys){
+    if (leader_){
+      std::vector<Staged> batch;
+      batch.reserve(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i){
+	batch.push_back(Staged(keys[i], T(), REMOVE, 0));
+      }
+      stage_batch(batch);
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      others_[0]->send("mremove", keys);
+    }
+  }
+
   void acknowledge(size_t query, size_t index){
+    std::unique_lock<std::mutex> olock(others_mutex_);
     std::unique_lock<std::mutex> qlock(queries_mutex_);
     if (queries_[query].who[index]) return;
     --queries_[query].acks;
     queries_[query].who[index] = true;
     if (queries_[query].acks == 0){
-      std::unique_lock<std::mutex> olock(others_mutex_);
       commit(query);
     }
   }
 
+  /* Leader: follower index staged every query in [first, last]. Whatever became
+     ready is committed and sent on as one commit_batch per follower. */
+  void acknowledge_batch(size_t first, size_t last, size_t index){
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::vector<size_t> ready;
+    for (size_t query = first; query <= last; ++query){
+      queries_.modify(query, [&](Query& q){
+	if (index >= q.who.size() || q.who[index]) return;
+	q.who[index] = true;
+	if (--q.acks == 0) ready.push_back(query);
+      });
+    }
+    if (ready.empty()) return;
+    for (size_t i = 0; i < ready.size(); ++i){
+      commit_local(ready[i]);
+    }
+    for (size_t i = 0; i < others_.size(); ++i){
+      others_[i]->send("commit_batch", ready);
+    }
+  }
+
   /* This relies on the fact that only 1 thread is executing the server calls
      -- Otherwise a query in progress (or a new query) could cause a lot of issues */
   void join(const std::string& addr, const size_t port){
     if (!leader_) return;
 
-    std::unique_lock<std::mutex> qlock(queries_mutex_);
     std::unique_lock<std::mutex> olock(others_mutex_);
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
     size_t ind = others_.size();
 
     others_.push_back(new rpc::client(addr, port));
@@ -144,9 +235,9 @@ class Server {
     
     /* Send all commited data */
     std::vector<std::future<clmdep_msgpack::object_handle>> futures;
-    typename KeyValueStore<std::string,T>::iterator it;
+    typename KVStore::iterator it;
     for (it = kv_.begin(); it != kv_.end(); ++it){
-      futures.push_back(others_[ind]->async_call("set", (*it).key, (*it).value));
+      futures.push_back(others_[ind]->async_call("set", std::string((*it).key.begin(), (*it).key.end()), (*it).value));
     }
     /* Make sure everything got there -- If it fails be pessemistic */
     for (size_t i = 0; i < futures.size(); ++i){
@@ -161,7 +252,7 @@ class Server {
     futures.clear();
 
     /* Send all of the in progress queries */
-    typename HashTable<size_t, Query>::iterator qit;
+    typename QueryTable::iterator qit;
     for (qit = queries_.begin(); qit != queries_.end(); ++qit){
       (*qit).value.who.push_back(false);
       ++(*qit).value.acks;
@@ -188,51 +279,97 @@ class Server {
   }
 
   void stage(const std::string& key, const T& val, Action act, size_t query, size_t index = 0){
-    std::unique_lock<std::mutex> qlock(queries_mutex_);
     std::unique_lock<std::mutex> olock(others_mutex_);
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    HashedKey<std::string> hkey(key);
     if (leader_){
       if (others_.size() == 0){
         switch(act){
           case PUT:
-    	    kv_.put(key, val);
+    	    kv_.put(hkey, val);
   	  break;
           case REMOVE:
-	    kv_.remove(key);
+	    kv_.remove(hkey);
 	  break;
         }
 	return;
       }
-      queries_.insert(query, Query(key, val, act, std::chrono::steady_clock::now(), others_.size()));
+      queries_.insert(query, Query(key, hkey.hash(), val, act, std::chrono::steady_clock::now(), others_.size()));
       for (size_t i = 0; i < others_.size(); ++i){
         others_[i]->send("stage", key, val, act, query, i);
       }
     }
     else {
-      queries_.insert(query, Query(key, val, act, std::chrono::steady_clock::now()));
+      queries_.insert(query, Query(key, hkey.hash(), val, act, std::chrono::steady_clock::now()));
       others_[0]->send("acknowledge", query, index);
     }
   }
 
-  /* Assumes thread already have control of queries_mutex_ and others_mutex_ */
+  /* Leader: stages the writes under consecutive queries and sends them to each follower
+     as a single stage_batch. Follower: stages a whole batch, then acknowledges it once. */
+  void stage_batch(std::vector<Staged>& batch, size_t index = 0){
+    if (batch.empty()) return;
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    TIME_STAMP now = std::chrono::steady_clock::now();
+    if (leader_){
+      for (size_t i = 0; i < batch.size(); ++i){
+	std::get<3>(batch[i]) = next_query_++;
+      }
+      for (size_t i = 0; i < batch.size(); ++i){
+	const std::string& key = std::get<0>(batch[i]);
+	HashedKey<std::string> hkey(key);
+	if (others_.size() == 0){
+	  if (std::get<2>(batch[i]) == PUT) kv_.put(hkey, std::get<1>(batch[i]));
+	  else kv_.remove(hkey);
+	  continue;
+	}
+	queries_.insert(std::get<3>(batch[i]), Query(key, hkey.hash(), std::get<1>(batch[i]), std::get<2>(batch[i]), now, others_.size()));
+      }
+      for (size_t i = 0; i < others_.size(); ++i){
+	others_[i]->send("stage_batch", batch, i);
+      }
+    }
+    else {
+      for (size_t i = 0; i < batch.size(); ++i){
+	const std::string& key = std::get<0>(batch[i]);
+	queries_.insert(std::get<3>(batch[i]), Query(key, KeyHash<std::string>()(key), std::get<1>(batch[i]), std::get<2>(batch[i]), now));
+      }
+      /* A batch holds consecutive queries */
+      others_[0]->send("acknowledge_batch", std::get<3>(batch.front()), std::get<3>(batch.back()), index);
+    }
+  }
+
+  /* Assumes thread already have control of others_mutex_ and queries_mutex_ */
   void commit(size_t query){
-    Query q = queries_[query];
-    queries_.remove(query);
-        switch (q.action){
+    commit_local(query);
+    if (leader_){
+      for (size_t i = 0; i < others_.size(); ++i){
+	others_[i]->send("commit", query);
+      }
+    }
+  }
+
+  /* Applies a commit to self only (the Leader also records how long it took) */
+  void commit_local(size_t query){
+    Query& q = queries_[query];
+    HashedKey<std::string> hkey(q.key, q.hash);
+    switch (q.action){
       case PUT:
-	kv_.put(q.key, q.val);
+	kv_.put(hkey, q.val); /* Shares q's value */
         break;
       case REMOVE:
-	kv_.remove(q.key);
+	kv_.remove(hkey);
         break;
     }
+    TIME_STAMP start = q.time;
+    Action action = q.action;
+    queries_.remove(query);
     if (leader_){
-      for (size_t i = 0; i < others_.size(); ++i){
-	others_[i]->send("commit", query);
-      }
       auto now = std::chrono::steady_clock::now();
-      size_t taken = std::chrono::duration_cast<std::chrono::nanoseconds>(now - q.time).count();
+      size_t taken = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
       std::unique_lock<std::mutex> tlock(times_mutex_);
-      times_.push_back(time_info(q.time, taken, q.action));
+      times_.push_back(time_info(start, taken, action));
     }
   }
 
@@ -258,11 +395,11 @@ class Server {
   }
 
   void cull(const std::vector<size_t>& dead){
-    /* always use q o a (nested locks) to avoid dead lock */
-    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    /* always use o q a (nested locks) to avoid dead lock */
     std::unique_lock<std::mutex> olock(others_mutex_);
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
     std::unique_lock<std::mutex> alock(alive_mutex_);
-    typename HashTable<size_t, Query>::iterator it;
+    typename QueryTable::iterator it;
     for (int i = dead.size()-1; 0 <= i; --i){
       delete others_[dead[i]];
       others_.erase(others_.begin()+dead[i]);
@@ -281,7 +418,7 @@ class Server {
   }
   
  public:
-   Server(size_t port=8080) : self_(new rpc::server(port)), leader_(false), ready_(false), pulse_(false), next_query_(0) {
+   Server(size_t port=8080) : self_(new rpc::server(port)), leader_(false), ready_(false), pulse_(false), kv_(SlabAllocator<char>(&kv_pool_)), queries_(SlabAllocator<char>(&queries_pool_)), next_query_(0) {
     register_funcs();
   }
 
@@ -372,8 +509,8 @@ class Server {
 	    self_ = new rpc::server(self_port);
 	    register_funcs();
 	    lock.unlock();
-	    kv_ = KeyValueStore<std::string, T>();
-	    queries_ = HashTable<size_t, Query>();
+	    kv_ = KVStore(SlabAllocator<char>(&kv_pool_));
+	    queries_ = QueryTable(SlabAllocator<char>(&queries_pool_));
 	    ready_ = false;
 	    while (others_[0]->get_connection_state() != rpc::client::connection_state::connected){
   	      delete others_[0];
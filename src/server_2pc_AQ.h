@@ -12,13 +12,20 @@
 #include "rpc/client.h"
 #include "key_value.h"
 #include "hash_table.h"
-#include "circular_buffer.h"
+#include "slab_allocator.h"
+#include "epoch_hash_table.h"
+#include "pending_versions.h"
+#include "shared_value.h"
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <iostream>
 #include <atomic>
+#include <tuple>
 
 #ifndef CM_SERVER_2PC_AQ
 #define CM_SERVER_2PC_AQ
@@ -26,6 +33,10 @@
 #define PUT 0
 #define REMOVE 1
 #define ALIVE_TIME 5000
+#define COMMIT_STRIPES 64	/* Condition variables that waiting gets share (by key hash) */
+#define ABSORB_WINDOW 200	/* Write absorption: us the Leader holds stages before sending them */
+#define ABSORB_BATCH 1024	/* ...or until this many are held */
+#define ABSORBED ((size_t)-1)	/* Query of a held stage a later write to its key replaced */
 
 std::mutex mtx_lead;
 
@@ -40,7 +51,8 @@ class Server {
   size_t id_;
   std::vector<bool> alive_others_;			/*Are others alive? */
 
-  typedef KeyValueStore<std::string, std::pair< std::pair<T,size_t>,CircularBuffer<size_t>>> KVStore;   		        /*Latest committed value and list of pending queries (new versions) */
+  typedef std::pair< std::pair<SharedValue<T>,size_t>,PendingVersions> KVEntry;	/*Latest committed value (shared with its query) and list of pending queries (new versions) */
+  typedef KeyValueStore<std::string, KVEntry, EpochHashTable<std::string, KVEntry>> KVStore;	/*gets never lock; writers hold others_mutex_ and queries_mutex_ */
   KVStore kv_;
 
   typedef char Action;
@@ -58,54 +70,151 @@ class Server {
 
   struct Query{
     Query() {}
-    Query(const std::string& k, const T& val, Action act, TimeStamp t,size_t a = 0, std::vector<bool> a_v ={true}) : key(k), val(val), action(act), time(t), acks(a), ack_vec(a_v) {}
+    Query(const std::string& k, size_t h, const SharedValue<T>& val, Action act, TimeStamp t,size_t a = 0, std::vector<bool> a_v ={true}) : key(k), hash(h), val(val), action(act), ack_vec(a_v), acks(a), time(t) {}
     std::string key;
-    T val;
+    size_t hash;    /* KeyHash of key, computed once in stage */
+    SharedValue<T> val;
     Action action;
     std::vector<bool> ack_vec;
     size_t acks;    /* If acks == 0 then ready to commit */
     TimeStamp time;
   };
 
-  HashTable<size_t, Query> queries_;
+  typedef std::tuple<std::string, SharedValue<T>, Action, size_t> Staged;	/* One write of a stage_batch: (key, val, action, query) */
+
+  SlabPool queries_pool_;								/* Entries of queries_ (declared first so it outlives them) */
+  typedef HashTable<size_t, Query, SlabAllocator<char>> QueryTable;
+  QueryTable queries_;
   size_t next_query_;
 
+  /* Nested locks are always taken others, queries, alive (as in 2PC) */
   std::mutex alive_mutex_;
   std::mutex others_mutex_;
   std::mutex queries_mutex_;
   std::mutex results_mutex_;
 
+  size_t commit_wait_;					/* ms a follower get on a dirty key waits for its commit before asking the leader (0: doesn't wait) */
+  std::condition_variable commit_cv_[COMMIT_STRIPES];	/* Notified (under queries_mutex_) by commits to keys hashing there */
+
+  bool absorb_;						/* Leader: hold stages so later writes to a key can absorb them */
+  std::vector<Staged> unsent_;				/* Held stages, oldest first (absorbed ones have query ABSORBED) */
+  HashTable<std::string, size_t> unsent_at_;		/* key -> index in unsent_ of its held stage */
+  std::atomic_bool stopping_;
+  std::thread absorber_;				/* Sends the held stages every ABSORB_WINDOW us */
+
   void register_funcs(){
     self_.bind("get", [this](std::string key){ return this->get(key); });
     self_.bind("put", [this](std::string key, T val){ this->put(key, val); });
     self_.bind("remove", [this](std::string key){ this->remove(key); });
+    self_.bind("mget", [this](std::vector<std::string> keys){ return this->mget(keys); });
+    self_.bind("mput", [this](std::vector<std::pair<std::string, T>> pairs){ this->mput(pairs); });
+    self_.bind("mremove", [this](std::vector<std::string> keys){ this->mremove(keys); });
 
     self_.bind("acknowledge", [this](size_t query, size_t id_no){ this->acknowledge(query,id_no); });
+    self_.bind("acknowledge_batch", [this](size_t first, size_t last, size_t id_no){ this->acknowledge_batch(first,last,id_no); });
     self_.bind("join", [this](std::string address, size_t port = 8080){ return this->join(address,port); });
     self_.bind("version", [this](std::string key){ return this->get_version(key);});			/*Leader gives version number*/
+    self_.bind("versions", [this](std::vector<std::string> keys){ return this->get_versions(keys);});	/*...for many keys at once*/
     self_.bind("alive", [this](size_t id_no){ (this->alive_others_[id_no]) = true; }) ;              /*Alive children*/
 
     self_.bind("stage", [this](std::string key, T val, Action act, size_t query, size_t id_no = 0){ this->stage(key, val, act, query, id_no); });
-    self_.bind("commit", [this](size_t query){ this->commit(query); });
+    self_.bind("stage_batch", [this](std::vector<Staged> batch, size_t id_no){ this->stage_batch(batch, id_no); });
+    self_.bind("commit", [this](size_t query){
+	std::unique_lock<std::mutex> olock(this->others_mutex_);
+	std::unique_lock<std::mutex> qlock(this->queries_mutex_);
+	this->commit(query);
+      });
     self_.bind("hello",  [this](size_t id_no){this->pulse_ = true; this->id_ = id_no; this->holler_back();}); 			/*still connected to leader*/
   }
 
 //Check if clean else ask leader for version number
-  T get(const std::string& key){
+  SharedValue<T> get(const std::string& key){
     if (leader_)
       return ((kv_.get(key)).first).first;
     if(!ready_){
       std::unique_lock<std::mutex> lock(others_mutex_);
-      return others_[0]->call("get",key).template as<T>();
+      return others_[0]->call("get",key).template as<SharedValue<T>>();
+    }
+    typename KVStore::find_t found = kv_.find(key);   /* one lock free lookup; absent keys read as clean T() */
+    if((found.value).second.size()==0){
+      return ((found.value).first).first;
     }
-    if(isclean(key)){
-     // std::cout<<key<<"\n";
-      return ((kv_.get(key)).first).first;  
+    if(commit_wait_ != 0){							//wait for the newest pending version to commit
+      size_t newest = 0;
+      for(size_t i = 0; i < (found.value).second.size(); i++)
+        newest = std::max(newest, (found.value).second[i]);
+      HashedKey<std::string> hkey(key);
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(commit_wait_);
+      std::unique_lock<std::mutex> qlock(queries_mutex_);
+      bool settled = commit_cv_[hkey.hash() % COMMIT_STRIPES].wait_until(qlock, deadline, [&](){
+          found = kv_.find(hkey);
+          return !found.found || ((found.value).first).second >= newest;	//absent keys read as clean T()
+        });
+      if(settled)
+        return ((found.value).first).first;
     }
     std::unique_lock<std::mutex> lock(others_mutex_);
     return get_val(others_[0]->call("version", key).template as<size_t>()); //Asks leader for version number
   }
 
+//Clean keys are served locally, all dirty keys share one round trip to the leader
+  std::vector<SharedValue<T>> mget(const std::vector<std::string>& keys){
+    std::vector<SharedValue<T>> vals;
+    vals.reserve(keys.size());
+    if (leader_){
+      for(size_t i = 0; i < keys.size(); i++)
+        vals.push_back(((kv_.get(keys[i])).first).first);
+      return vals;
+    }
+    if(!ready_){
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      return others_[0]->call("mget",keys).template as<std::vector<SharedValue<T>>>();
+    }
+    std::vector<std::string> dirty;
+    std::vector<size_t> where;
+    for(size_t i = 0; i < keys.size(); i++){
+      typename KVStore::find_t found = kv_.find(keys[i]);
+      vals.push_back(((found.value).first).first);
+      if((found.value).second.size()!=0){
+        dirty.push_back(keys[i]);
+        where.push_back(i);
+      }
+    }
+    if(dirty.empty())
+      return vals;
+    std::unique_lock<std::mutex> lock(others_mutex_);
+    std::vector<size_t> versions = others_[0]->call("versions", dirty).template as<std::vector<size_t>>();
+    lock.unlock();
+    for(size_t i = 0; i < where.size() && i < versions.size(); i++)
+      vals[where[i]] = get_val(versions[i]);
+    return vals;
+  }
+
+//The writes of an mput / mremove are staged together as one stage_batch
+  void mput(const std::vector<std::pair<std::string, T>>& pairs){
+    if (leader_){
+      std::vector<Staged> batch;
+      for(size_t i = 0; i < pairs.size(); i++)
+        batch.push_back(Staged(pairs[i].first, pairs[i].second, PUT, 0));
+      stage_batch(batch);
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      others_[0]->send("mput", pairs);
+    }
+  }
+
+  void mremove(const std::vector<std::string>& keys){
+    if (leader_){
+      std::vector<Staged> batch;
+      for(size_t i = 0; i < keys.size(); i++)
+        batch.push_back(Staged(keys[i], T(), REMOVE, 0));
+      stage_batch(batch);
+    } else {
+      std::unique_lock<std::mutex> lock(others_mutex_);
+      others_[0]->send("mremove", keys);
+    }
+  }
+
   void put(const std::string& key, const T& val){
     if (leader_){
       stage(key, val, PUT, next_query_++);
@@ -117,18 +226,12 @@ class Server {
 
 /* Checks if value is unique */
 bool isclean(const std::string& key){
-    CircularBuffer<size_t> tmp_ver((kv_.get(key)).second); 
-    if(tmp_ver.size()==0){
-       return true;
-    }
-    return false;
+    return ((kv_.find(key)).value).second.size()==0;
   }
 
-/* Add new version to the circualr buffer */
-void add_version(const std::string& key, size_t query){
-   CircularBuffer<size_t> new_ver((kv_.get(key)).second);
-   new_ver.insert(query);
-   kv_.put(key,std::make_pair((kv_.get(key)).first, new_ver));
+/* Add new version to the circualr buffer (one probe, no copy of the committed value) */
+void add_version(const HashedKey<std::string>& key, size_t query){
+   kv_.upsert(key, [query](KVEntry& entry){ entry.second.insert(query); });
 }
   
 void remove(const std::string& key){
@@ -142,35 +245,102 @@ void remove(const std::string& key){
   }
 
 void acknowledge(size_t query, size_t id_no){
+    std::unique_lock<std::mutex> olock(others_mutex_);		//others_mutex_ first, like every other path
     std::unique_lock<std::mutex> qlock(queries_mutex_);
-    if(!(queries_[query].ack_vec)[id_no]){                //no double counting
-       --queries_[query].acks;
-       (queries_[query].ack_vec)[id_no] = true;          //keep track of who acknowledges
-       if (queries_[query].acks == 0){
+    bool ready = false;
+    queries_.modify(query, [&](Query& q){
+      if(id_no >= q.ack_vec.size() || q.ack_vec[id_no]) return;	//no double counting (absorbed queries aren't there)
+      q.ack_vec[id_no] = true;						//keep track of who acknowledges
+      ready = (--q.acks == 0);
+    });
+    if(ready)
+      commit(query);
+  }
+/* Follower id_no staged every query in [first, last] */
+void acknowledge_batch(size_t first, size_t last, size_t id_no){
     std::unique_lock<std::mutex> olock(others_mutex_);
-         commit(query);
-       }
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    std::vector<size_t> ready;
+    for(size_t query = first; query <= last; query++){
+      queries_.modify(query, [&](Query& q){
+        if(id_no >= q.ack_vec.size() || q.ack_vec[id_no]) return;	//no double counting (skipped stale queries aren't there)
+        q.ack_vec[id_no] = true;
+        if(--q.acks == 0) ready.push_back(query);
+      });
     }
+    for(size_t i = 0; i < ready.size(); i++)
+      commit(ready[i]);
   }
+
+/* Leader: stages the writes under consecutive queries, one stage_batch per follower.
+   Follower: stages a whole batch and acknowledges it once */
+void stage_batch(std::vector<Staged>& batch, size_t id_no = 0){
+    if(batch.empty())
+      return;
+    std::unique_lock<std::mutex> olock(others_mutex_);
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    if(leader_)
+      for(size_t i = 0; i < batch.size(); i++)
+        std::get<3>(batch[i]) = next_query_++;
+    else
+      while(!ready_)								//Don't stage acknowledge any stage request till ready
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    for(size_t i = 0; i < batch.size(); i++){
+      const std::string& key = std::get<0>(batch[i]);
+      size_t query = std::get<3>(batch[i]);
+      HashedKey<std::string> hkey(key);
+      if( ((kv_.get(hkey)).first).second > query )				//never stage a version older than the committed version
+        continue;
+      if(leader_ && others_.size() == 0){
+        if(std::get<2>(batch[i]) == PUT)
+          kv_.put(hkey, std::make_pair(std::make_pair(std::get<1>(batch[i]),query), PendingVersions()));
+        else
+          kv_.remove(hkey);
+        continue;
+      }
+      if(leader_)
+        queries_.insert(query, Query(key, hkey.hash(), std::get<1>(batch[i]), std::get<2>(batch[i]), now, others_.size(), std::vector<bool>(others_.size())));
+      else
+        queries_.insert(query, Query(key, hkey.hash(), std::get<1>(batch[i]), std::get<2>(batch[i]), now));
+      add_version(hkey,query);
+      if(leader_ && absorb_)
+        hold(hkey, std::get<1>(batch[i]), std::get<2>(batch[i]), query);
+    }
+    if(leader_){
+      if(!absorb_)								//held stages are sent by flush
+        for(size_t i = 0; i < others_.size(); i++)
+          others_[i]->send("stage_batch", batch, i);
+    }
+    else
+      others_[0]->send("acknowledge_batch", std::get<3>(batch.front()), std::get<3>(batch.back()), id_no);
+  }
+
  void stage(const std::string& key, const T& val, Action act, size_t query, size_t id_no =0){
     std::unique_lock<std::mutex> olock(others_mutex_);
     std::unique_lock<std::mutex> qlock(queries_mutex_);
-    if( ((kv_.get(key)).first).second > query ) 								 	//never stage a version older than the committed version
+    HashedKey<std::string> hkey(key);								//key is hashed once for the whole stage/commit
+    if( ((kv_.get(hkey)).first).second > query ) 								 	//never stage a version older than the committed version
       return;
     if (leader_){
       if (others_.size() == 0){
         switch(act){
           case PUT:
-    	    kv_.put(key, std::make_pair(std::make_pair(val,query), CircularBuffer<size_t>() )); 			//new value and empty list
+    	    kv_.put(hkey, std::make_pair(std::make_pair(val,query), PendingVersions() )); 			//new value and empty list
   	  break;
           case REMOVE:
-	    kv_.remove(key);
+	    kv_.remove(hkey);
 	  break;
         }
         return;
       }
-      queries_.insert(query, Query(key, val, act, std::chrono::steady_clock::now(), others_.size(),std::vector<bool>(others_.size()) ));
-      add_version(key,query);			
+      SharedValue<T> shared(val);
+      queries_.insert(query, Query(key, hkey.hash(), shared, act, std::chrono::steady_clock::now(), others_.size(),std::vector<bool>(others_.size()) ));
+      add_version(hkey,query);			
+      if (absorb_){
+        hold(hkey, shared, act, query);
+        return;
+      }
       for (size_t i = 0; i < others_.size(); ++i){
         others_[i]->send("stage", key, val, act, query, i);
       }
@@ -179,33 +349,90 @@ void acknowledge(size_t query, size_t id_no){
       while(!ready_){                                             		//Don't stage acknowledge any stage request till ready
         std::this_thread::sleep_for(std::chrono::milliseconds(2));
       }
-      queries_.insert(query, Query(key, val, act,std::chrono::steady_clock::now()));
-      add_version(key,query);				
+      queries_.insert(query, Query(key, hkey.hash(), val, act,std::chrono::steady_clock::now()));
+      add_version(hkey,query);				
       others_[0]->send("acknowledge", query, id_no);
     }
   }
 
 
+/* Leader (absorb_): holds a stage for the next flush. A held stage of the same key is
+   superseded by it: that query is dropped here (no follower ever saw it, and no get could
+   have, as it never committed) so only the newest write per key is replicated.
+   Assumes thread already have control of others_mutex_ and queries_mutex_ */
+void hold(const HashedKey<std::string>& hkey, const SharedValue<T>& val, Action act, size_t query){
+    bool absorbed = unsent_at_.modify(hkey, [&](size_t& at){
+        size_t old = std::get<3>(unsent_[at]);
+        std::get<1>(unsent_[at]) = SharedValue<T>();
+        std::get<3>(unsent_[at]) = ABSORBED;
+        queries_.remove(old);
+        kv_.upsert(hkey, [old](KVEntry& entry){ entry.second.remove_element(old); });
+        at = unsent_.size();
+      });
+    if(!absorbed)
+      unsent_at_.insert(hkey, unsent_.size());
+    unsent_.push_back(Staged(hkey.key(), val, act, query));
+    if(unsent_.size() >= ABSORB_BATCH)
+      flush();
+  }
+
+/* Leader (absorb_): sends the held stages (in query order, so every key's stay in order)
+   as one stage_batch per follower. Assumes thread already have control of others_mutex_
+   and queries_mutex_ */
+void flush(){
+    if(unsent_.empty())
+      return;
+    std::vector<Staged> batch;
+    batch.reserve(unsent_.size());
+    for(size_t i = 0; i < unsent_.size(); i++)
+      if(std::get<3>(unsent_[i]) != ABSORBED)
+        batch.push_back(std::move(unsent_[i]));
+    unsent_.clear();
+    unsent_at_ = HashTable<std::string, size_t>();
+    for(size_t i = 0; i < others_.size(); i++)
+      others_[i]->send("stage_batch", batch, i);
+  }
+
+void absorber(){
+    while(!stopping_){
+      std::this_thread::sleep_for(std::chrono::microseconds(ABSORB_WINDOW));
+      std::unique_lock<std::mutex> olock(others_mutex_);
+      std::unique_lock<std::mutex> qlock(queries_mutex_);
+      flush();
+    }
+  }
+
   void commit(size_t query){
-    Query q = queries_[query];
+    Query q = std::move(queries_[query]);					//the entry is removed right away so steal it (the value is shared, not copied)
     queries_.remove(query);
-    CircularBuffer<size_t> tmp_ver((kv_.get(q.key)).second);
-    std::vector<size_t> rm_ver = tmp_ver.remove_smaller(query);			//Removes all earlier queries to the same key from circular buffer
+    HashedKey<std::string> hkey(q.key, q.hash);
+    std::vector<size_t> rm_ver;
+    bool stale = false;
+    bool erase = false;
+    kv_.upsert(hkey, [&](KVEntry& entry){					//one probe for the whole update
+      (entry.second).prune_upto(query, rm_ver);				//Removes this and all earlier queries to the same key from the pending versions
+      if((entry.first).second > query){						//Assumes all later queries have higher number
+        stale = true;								//never commit an older version
+        return;
+      }
+      switch (q.action){
+        case PUT:
+	  entry.first = std::make_pair(std::move(q.val),query);			//update latest commit value and query number
+          break;
+        case REMOVE:
+          if((entry.second).size()==0) erase = true;				//is this necessary?
+          else entry.first = std::make_pair(SharedValue<T>(),query);
+          break;
+      }
+    });
     for(size_t i = 0; i < rm_ver.size(); i++)
       queries_.remove(rm_ver[i]);						//Remove the corresponding queries from the main query list
-    if(((kv_.get(q.key)).first).second > query)         			//Assumes all later queries have higher number				
-      return;  									//never commit an older version
-    switch (q.action){
-      case PUT:
-	kv_.put(q.key, std::make_pair(std::make_pair(q.val,query),tmp_ver));     //update latest commit value and query number 
-        break;
-      case REMOVE:
-        if(tmp_ver.size()==0) kv_.remove(q.key);			//is this necessary?
-        else{
-          kv_.put(q.key, std::make_pair(std::make_pair(T(),query),tmp_ver));
-        }
-        break;
-    }
+    if(commit_wait_ != 0)
+      commit_cv_[hkey.hash() % COMMIT_STRIPES].notify_all();			//wake gets waiting on this key
+    if(stale)
+      return;
+    if(erase)
+      kv_.remove(hkey);
     if (leader_){
       for (size_t i = 0; i < others_.size(); ++i){
 	others_[i]->send("commit", query);
@@ -223,17 +450,24 @@ size_t get_version(const std::string& key){
       	return ((kv_.get(key)).first).second;
 }  
 
+std::vector<size_t> get_versions(const std::vector<std::string>& keys){
+  std::vector<size_t> versions;
+  for(size_t i = 0; i < keys.size(); i++)
+    versions.push_back(get_version(keys[i]));
+  return versions;
+}
+
 /* Value of the given version/query */
-T get_val(size_t query){
+SharedValue<T> get_val(size_t query){
    std::unique_lock<std::mutex> lock(queries_mutex_);
-   Query q = queries_[query];
+   const Query& q = queries_[query];
    switch(q.action){
       case PUT:
         return q.val;
       case REMOVE:
-        return T();
+        return SharedValue<T>();
    }
-   return T();
+   return SharedValue<T>();
 }
 
 void hello_world()
@@ -252,9 +486,9 @@ void holler_back(){
 
 /*checks if it's a duplicate rejoin else adds to list of others */
 /* returns vector of commited values */
-std::pair<bool,std::vector<std::pair<std::string,std::pair<T,size_t>>>> join(const std::string& address, const size_t port){
+std::pair<bool,std::vector<std::pair<std::string,std::pair<SharedValue<T>,size_t>>>> join(const std::string& address, const size_t port){
   std::unique_lock<std::mutex> lock(others_mutex_);
-  std::vector<std::pair<std::string,std::pair<T,size_t>>> committed_kv;
+  std::vector<std::pair<std::string,std::pair<SharedValue<T>,size_t>>> committed_kv;
   size_t ind = others_.size();
 
   /* check if already part of others*/
@@ -262,6 +496,10 @@ std::pair<bool,std::vector<std::pair<std::string,std::pair<T,size_t>>>> join(con
     if(others_addr_[i] == std::make_pair(address,port))
       return std::make_pair(true,committed_kv);
   }
+  if(absorb_){								//held stages go to the others first, then to it with the rest below
+    std::unique_lock<std::mutex> qlock(queries_mutex_);
+    flush();
+  }
   std::unique_lock<std::mutex> alock(alive_mutex_);
   others_.push_back( new rpc::client(address, port));
   alive_others_.push_back(true);
@@ -273,7 +511,7 @@ std::pair<bool,std::vector<std::pair<std::string,std::pair<T,size_t>>>> join(con
   
 
     /* Send all of the in progress queries */
-    typename HashTable<size_t, Query>::iterator qit;
+    typename QueryTable::iterator qit;
     for (qit = queries_.begin(); qit != queries_.end(); ++qit){
       ++(*qit).value.acks;
       ((*qit).value.ack_vec).push_back(false);
@@ -281,16 +519,16 @@ std::pair<bool,std::vector<std::pair<std::string,std::pair<T,size_t>>>> join(con
     }
 
     /* Send all commited data */
-    typename KeyValueStore<std::string,std::pair<std::pair<T,size_t>,CircularBuffer<size_t>>>::iterator it;
+    typename KVStore::iterator it;
     for (it = kv_.begin(); it != kv_.end(); ++it){
       committed_kv.push_back(std::make_pair((*it).key,((*it).value).first));
     }
     return std::make_pair(false,committed_kv);
  }
 
-void make_kvstore(const std::vector<std::pair<std::string,std::pair<T,size_t>>>& committed_kv){
+void make_kvstore(const std::vector<std::pair<std::string,std::pair<SharedValue<T>,size_t>>>& committed_kv){
   for(size_t i=0; i < committed_kv.size(); i++){
-    kv_.put(committed_kv[i].first, std::make_pair(committed_kv[i].second, CircularBuffer<size_t>()));
+    kv_.put(committed_kv[i].first, std::make_pair(committed_kv[i].second, PendingVersions()));
   }
   ready_ = true;
   std::cout<<"Ready!";
@@ -313,10 +551,13 @@ void kill(size_t id_no){
 */
 
  public:
-  Server(size_t port=8080) : self_(port), leader_(false), next_query_(0), ready_(false) {
+  Server(size_t port=8080, size_t commit_wait=0, bool absorb=false) : self_(port), leader_(false), ready_(false), queries_(SlabAllocator<char>(&queries_pool_)), next_query_(0), commit_wait_(commit_wait), absorb_(absorb), stopping_(false) {
     register_funcs();
   }
   ~Server(){
+     stopping_ = true;
+     if (absorber_.joinable())
+       absorber_.join();
      for (size_t i = 0; i < others_.size(); ++i){
        delete others_[i];
      }
@@ -326,12 +567,14 @@ void kill(size_t id_no){
     rpc::client client(address, port);
     //rpc::client self_c(self_addr,self_port);
     std::pair<std::string, size_t> leader = client.call("leader", self_addr, self_port).as<std::pair<std::string, size_t>>();
-    typename HashTable<size_t, Query>::iterator qit;
-    std::pair<bool,std::vector<std::pair<std::string,std::pair<T,size_t>>>> j_response;
+    typename QueryTable::iterator qit;
+    std::pair<bool,std::vector<std::pair<std::string,std::pair<SharedValue<T>,size_t>>>> j_response;
     self_.async_run();
     if (leader == std::make_pair(self_addr, self_port)){
       leader_ = true;
       ready_ =true;
+      if(absorb_)
+        absorber_ = std::thread([this](){ this->absorber(); });
       auto leader_start = std::chrono::steady_clock::now();
       while(1){
         hello_world();							//sends hello to other nodes
@@ -339,8 +582,10 @@ void kill(size_t id_no){
 
         /* Checks if others are still alive */
         std::unique_lock<std::mutex> olock(others_mutex_);
-        std::unique_lock<std::mutex> alock(alive_mutex_);
         std::unique_lock<std::mutex> qlock(queries_mutex_);
+        std::unique_lock<std::mutex> alock(alive_mutex_);
+        if(absorb_)
+          flush();							//nothing held may commit on acknowledgements of dead nodes alone
         
         for(size_t i=0; i<others_.size();i++){
            if(!alive_others_[i]){
@@ -353,8 +598,7 @@ void kill(size_t id_no){
                       --queries_[query].acks;
                      (queries_[query].ack_vec)[i] = true;          //keep track of who acknowledges
                       if (queries_[query].acks == 0){
-                         std::unique_lock<std::mutex> olock(others_mutex_);
-                         commit(query);
+                         commit(query);					//already holds others_mutex_
                       }
                     }       
 
@@ -395,7 +639,7 @@ void kill(size_t id_no){
         std::unique_lock<std::mutex> olock(others_mutex_);
        
         while (others_[0]->get_connection_state() != rpc::client::connection_state::connected);
-        j_response = others_[0]->call("join", self_addr, self_port).template as<std::pair<bool,std::vector<std::pair<std::string,std::pair<T,size_t>>>>>(); 
+        j_response = others_[0]->call("join", self_addr, self_port).template as<std::pair<bool,std::vector<std::pair<std::string,std::pair<SharedValue<T>,size_t>>>>>(); 
         olock.unlock();
         ready_=j_response.first;
         if(!ready_){							//If not ready build key value store
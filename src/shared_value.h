@@ -0,0 +1,66 @@
+/*********************************************************************************************
+   Description: An immutable value shared by reference count.
+                SharedValue<T> keeps one const T on the heap and copying it only copies a
+                pointer, so a written value is copied once (when it is staged) and from then on
+                the query, the key value store and every get that returns it share those bytes.
+                It is built from a T (moving from it when it can) and reads as a const T&; a
+                default SharedValue reads as T().
+                It packs as, and unpacks from, a plain T, so it can stand in for T in RPC
+                signatures and responses are encoded straight from the shared copy.
+
+ *********************************************************************************************/
+#include "rpc/msgpack.hpp"
+#include <memory>
+#include <utility>
+
+#ifndef CM_SHARED_VALUE
+#define CM_SHARED_VALUE
+
+template <class T>
+class SharedValue {
+  std::shared_ptr<const T> ptr_;
+
+  static const T& empty(){
+    static const T value = T();
+    return value;
+  }
+
+ public:
+  SharedValue() {}
+  SharedValue(const T& value) : ptr_(std::make_shared<const T>(value)) {}
+  SharedValue(T&& value) : ptr_(std::make_shared<const T>(std::move(value))) {}
+
+  const T& get() const {
+    return ptr_ ? *ptr_ : empty();
+  }
+
+  operator const T&() const {
+    return get();
+  }
+};
+
+namespace clmdep_msgpack {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+template <class T>
+struct pack<SharedValue<T>> {
+  template <class Stream>
+  packer<Stream>& operator()(packer<Stream>& o, const SharedValue<T>& v) const {
+    return o << v.get();
+  }
+};
+
+template <class T>
+struct convert<SharedValue<T>> {
+  const object& operator()(const object& o, SharedValue<T>& v) const {
+    v = SharedValue<T>(o.as<T>());
+    return o;
+  }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
+} // namespace clmdep_msgpack
+
+#endif
@@ -0,0 +1,162 @@
+/*********************************************************************************************
+   Description: A slab allocator for the many small, similarly sized blocks a hash table
+                makes (bucket arrays of entries, key bytes).
+                A SlabPool carves blocks out of SLAB_BYTES slabs, rounding each request up
+                to a multiple of SLAB_ALIGN (instead of malloc's 16 plus a header) and keeps
+                one free list per size. Freed blocks are reused by later requests of the same
+                size; slabs are only returned when the pool is destroyed. Requests larger
+                than SLAB_MAX_BLOCK go to ::operator new.
+                A pool is not thread safe: it must be guarded like the table that uses it.
+                SlabAllocator<T> is a standard allocator over a pool (or over ::operator new
+                when it has none), so it can back std::vector and std::basic_string.
+                SlabString is a string whose characters live in the pool.
+
+ *********************************************************************************************/
+#include "hashed_key.h"
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef CM_SLAB_ALLOCATOR
+#define CM_SLAB_ALLOCATOR
+
+#define SLAB_BYTES 65536     /* Bytes per slab */
+#define SLAB_ALIGN 8         /* Block sizes are multiples of this */
+#define SLAB_MAX_BLOCK 512   /* Largest block served from slabs */
+
+class SlabPool {
+  struct free_t{ free_t* next; };
+
+  std::vector<char*> slabs_;
+  free_t* free_[SLAB_MAX_BLOCK / SLAB_ALIGN + 1];  /* free_[i] holds blocks of i*SLAB_ALIGN bytes */
+  char* cursor_;                                  /* Unused tail of the newest slab */
+  size_t left_;
+
+  static size_t class_of(size_t bytes){
+    return (bytes + SLAB_ALIGN - 1) / SLAB_ALIGN;
+  }
+
+ public:
+  SlabPool() : cursor_(NULL), left_(0) {
+    for (size_t i = 0; i <= SLAB_MAX_BLOCK / SLAB_ALIGN; ++i){
+      free_[i] = NULL;
+    }
+  }
+
+  ~SlabPool(){
+    for (size_t i = 0; i < slabs_.size(); ++i){
+      ::operator delete(slabs_[i]);
+    }
+  }
+
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator = (const SlabPool&) = delete;
+
+  void* allocate(size_t bytes){
+    if (bytes > SLAB_MAX_BLOCK){
+      return ::operator new(bytes);
+    }
+    size_t c = class_of(bytes == 0 ? 1 : bytes);
+    if (free_[c] != NULL){
+      free_t* block = free_[c];
+      free_[c] = block->next;
+      return block;
+    }
+    size_t size = c * SLAB_ALIGN;
+    if (left_ < size){
+      /* The rest of the old slab is too small for this class; hand it to the smaller ones */
+      if (left_ >= SLAB_ALIGN){
+	deallocate(cursor_, left_);
+      }
+      cursor_ = static_cast<char*>(::operator new(SLAB_BYTES));
+      slabs_.push_back(cursor_);
+      left_ = SLAB_BYTES;
+    }
+    void* block = cursor_;
+    cursor_ += size;
+    left_ -= size;
+    return block;
+  }
+
+  void deallocate(void* ptr, size_t bytes){
+    if (ptr == NULL){ return; }
+    if (bytes > SLAB_MAX_BLOCK){
+      ::operator delete(ptr);
+      return;
+    }
+    size_t c = class_of(bytes == 0 ? 1 : bytes);
+    free_t* block = static_cast<free_t*>(ptr);
+    block->next = free_[c];
+    free_[c] = block;
+  }
+};
+
+template <class T>
+class SlabAllocator {
+  template <class U> friend class SlabAllocator;
+  SlabPool* pool_;  /* NULL: plain ::operator new */
+
+ public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template <class U> struct rebind { typedef SlabAllocator<U> other; };
+
+  /* Containers swap and move their allocators along with their storage */
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  SlabAllocator() : pool_(NULL) {}
+  explicit SlabAllocator(SlabPool* pool) : pool_(pool) {}
+  template <class U>
+  SlabAllocator(const SlabAllocator<U>& other) : pool_(other.pool_) {}
+
+  SlabPool* pool() const { return pool_; }
+
+  T* allocate(size_t n){
+    /* Slab blocks are only SLAB_ALIGN aligned */
+    if (pool_ == NULL || alignof(T) > SLAB_ALIGN){
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(pool_->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, size_t n){
+    if (pool_ == NULL || alignof(T) > SLAB_ALIGN){
+      ::operator delete(ptr);
+      return;
+    }
+    pool_->deallocate(ptr, n * sizeof(T));
+  }
+
+  template <class U>
+  bool operator ==(const SlabAllocator<U>& other) const { return pool_ == other.pool_; }
+  template <class U>
+  bool operator !=(const SlabAllocator<U>& other) const { return pool_ != other.pool_; }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, SlabAllocator<char>> SlabString;
+
+/* SlabString keys hash and compare like the std::string / KeyView holding the same bytes */
+template <>
+struct KeyHash<SlabString> {
+  size_t operator()(const SlabString& key) const { return hash_bytes(key.data(), key.size()); }
+};
+
+inline bool operator ==(const SlabString& a, const KeyView& b){
+  return a.size() == b.size && std::memcmp(a.data(), b.data, b.size) == 0;
+}
+
+inline bool operator ==(const SlabString& a, const std::string& b){
+  return a == KeyView(b);
+}
+
+#endif